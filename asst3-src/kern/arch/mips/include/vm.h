@@ -126,11 +126,11 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space losing the page */
+	vaddr_t ts_vaddr;		/* page-aligned user address */
 };
 
 #define TLBSHOOTDOWN_MAX 16
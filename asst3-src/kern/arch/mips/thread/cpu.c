@@ -100,6 +100,21 @@ cpu_machdep_init(struct cpu *c)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Return the current CPU's cycle counter (the coprocessor 0 count
+ * register).
+ */
+uint32_t
+cpu_getcycles(void)
+{
+	uint32_t count;
+
+	__asm volatile("mfc0 %0,$9" : "=r" (count));
+	return count;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Return the type name of the currently running CPU.
  *
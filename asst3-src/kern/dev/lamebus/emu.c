@@ -261,6 +261,19 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	return result;
 }
 
+/*
+ * Transfers to and from user memory go through a kernel bounce
+ * buffer, so that we never touch user memory while holding e_lock:
+ * a page fault there can read the page in from the program's
+ * executable, which may well be on this device too.
+ */
+static
+bool
+emu_needbounce(struct uio *uio)
+{
+	return uio->uio_segflg != UIO_SYSSPACE;
+}
+
 /*
  * Common code for read and readdir.
  */
@@ -269,6 +282,9 @@ int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce = NULL;
+	uint32_t amt;
+	off_t newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
@@ -278,6 +294,13 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return 0;
 	}
 
+	if (emu_needbounce(uio)) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -286,16 +309,30 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
+		lock_release(sc->e_lock);
 		goto out;
 	}
 
 	membar_load_load();
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	amt = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, amt, uio);
+		lock_release(sc->e_lock);
+	}
+	else {
+		KASSERT(amt <= len);
+		memcpy(bounce, sc->e_iobuf, amt);
+		lock_release(sc->e_lock);
+		result = uiomove(bounce, amt, uio);
+	}
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	uio->uio_offset = newoffset;
 
  out:
-	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -329,6 +366,8 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce = NULL;
+	off_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
@@ -337,13 +376,33 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return EFBIG;
 	}
 
+	/* Pick up the user's data first (see emu_needbounce) */
+	offset = uio->uio_offset;
+	if (emu_needbounce(uio)) {
+		bounce = kmalloc(len);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
+		result = 0;
+	}
 	membar_store_store();
 	if (result) {
 		goto out;
@@ -354,6 +413,9 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -473,12 +535,10 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need all of these locks, e_lock to protect the device,
-	 * vfs_biglock to protect the fs-related material, and
-	 * vn_countlock for the reference count.
+	 * Need both of these locks, e_lock to protect the device and
+	 * the vnode table, and vn_countlock for the reference count.
 	 */
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 	spinlock_acquire(&ev->ev_v.vn_countlock);
 
@@ -488,7 +548,6 @@ emufs_reclaim(struct vnode *v)
 
 		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
 	KASSERT(ev->ev_v.vn_refcount == 1);
@@ -503,7 +562,6 @@ emufs_reclaim(struct vnode *v)
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -527,7 +585,6 @@ emufs_reclaim(struct vnode *v)
 	vnode_cleanup(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	kfree(ev);
 	return 0;
@@ -743,16 +800,13 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
 	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
@@ -776,16 +830,13 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
@@ -1156,7 +1207,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1169,7 +1219,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1190,7 +1239,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			    &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1200,13 +1248,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
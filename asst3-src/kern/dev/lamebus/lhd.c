@@ -37,6 +37,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +61,15 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * Request scheduling. Waiting requests are served in C-LOOK order:
+ * the nearest one at or beyond the head, sweeping upward, then back
+ * to the lowest. A request that has waited longer than LHD_DEADLINE_NS
+ * goes next regardless, so a busy region can't starve the rest of the
+ * disk.
+ */
+#define LHD_DEADLINE_NS 200000000	/* 200 ms */
+
 /*
  * Shortcut for reading a register.
  */
@@ -179,14 +189,251 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Transfer one sector. The caller's request has the disk.
+ */
+static
+int
+lhd_iosector(struct lhd_softc *lh, uint32_t sector, uint32_t statval,
+	     struct uio *uio)
+{
+	int result;
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		membar_store_store();
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+
+	/* Now wait until the interrupt handler tells us we're done. */
+	P(lh->lh_done);
+
+	/* Get the result value saved by the interrupt handler. */
+	result = lh->lh_result;
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (result==0 && uio->uio_rw==UIO_READ) {
+		membar_load_load();
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	}
+
+	return result;
+}
+
+static
+uint64_t
+lhd_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * (uint64_t)1000000000 + ts->tv_nsec;
+}
+
+/*
+ * Choose the next request to get the disk and take it off the queue.
+ * Returns NULL if there are none. Called with lh_qlock held.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *r, *best, *lowest, **pp;
+	struct timespec now, age;
+
+	KASSERT(lock_do_i_hold(lh->lh_qlock));
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	/* The queue is in arrival order, so the head is the oldest. */
+	gettime(&now);
+	timespec_sub(&now, &lh->lh_queue->lr_queued, &age);
+	if (lhd_ns(&age) > LHD_DEADLINE_NS) {
+		best = lh->lh_queue;
+		lh->lh_stats.ls_deadline++;
+	}
+	else {
+		/* C-LOOK */
+		best = lowest = NULL;
+		for (r = lh->lh_queue; r != NULL; r = r->lr_next) {
+			if (r->lr_sector >= lh->lh_headpos &&
+			    (best == NULL || r->lr_sector < best->lr_sector)) {
+				best = r;
+			}
+			if (lowest == NULL || r->lr_sector < lowest->lr_sector) {
+				lowest = r;
+			}
+		}
+		if (best == NULL) {
+			/* nothing ahead of the head; wrap around */
+			best = lowest;
+		}
+	}
+
+	for (pp = &lh->lh_queue; *pp != best; pp = &(*pp)->lr_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = best->lr_next;
+	best->lr_next = NULL;
+	return best;
+}
+
+/*
+ * Give request R the disk: account for it, and wake it up if it is
+ * waiting. Called with lh_qlock held.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh, struct lhd_request *r)
+{
+	struct timespec now, wait;
+
+	KASSERT(!lh->lh_busy);
+	lh->lh_busy = true;
+
+	gettime(&now);
+	timespec_sub(&now, &r->lr_queued, &wait);
+	lh->lh_stats.ls_waitns += lhd_ns(&wait);
+
+	if (r->lr_sector == lh->lh_headpos) {
+		/* as good as merged with the last request */
+		lh->lh_stats.ls_contiguous++;
+	}
+	else if (r->lr_sector > lh->lh_headpos) {
+		lh->lh_stats.ls_seek += r->lr_sector - lh->lh_headpos;
+	}
+	else {
+		lh->lh_stats.ls_seek += lh->lh_headpos - r->lr_sector;
+	}
+
+	r->lr_go = true;
+	if (r->lr_cv != NULL) {
+		cv_signal(r->lr_cv, lh->lh_qlock);
+	}
+	else {
+		cv_broadcast(lh->lh_qcv, lh->lh_qlock);
+	}
+}
+
+/*
+ * Queue request R and wait until it is chosen to use the disk.
+ *
+ * If the disk looks busy, R gets a cv of its own to wait on, so that
+ * handing the disk over wakes only R. It's made before taking
+ * lh_qlock because kmalloc can end up paging to this very disk. If
+ * that fails, or the disk only turns busy after we looked, R waits on
+ * the shared lh_qcv instead.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *r)
+{
+	struct lhd_request **pp;
+
+	gettime(&r->lr_queued);
+	r->lr_go = false;
+	r->lr_cv = lh->lh_busy ? cv_create("lhd-req") : NULL;
+	r->lr_next = NULL;
+
+	lock_acquire(lh->lh_qlock);
+
+	lh->lh_depth++;
+	lh->lh_stats.ls_depthsum += lh->lh_depth;
+	if (lh->lh_depth > lh->lh_stats.ls_maxdepth) {
+		lh->lh_stats.ls_maxdepth = lh->lh_depth;
+	}
+
+	if (!lh->lh_busy) {
+		/* idle disk; nothing to schedule */
+		KASSERT(lh->lh_queue == NULL);
+		lhd_dispatch(lh, r);
+	}
+	else {
+		for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next);
+		*pp = r;
+		while (!r->lr_go) {
+			cv_wait(r->lr_cv != NULL ? r->lr_cv : lh->lh_qcv,
+				lh->lh_qlock);
+		}
+	}
+
+	lock_release(lh->lh_qlock);
+
+	if (r->lr_cv != NULL) {
+		cv_destroy(r->lr_cv);
+		r->lr_cv = NULL;
+	}
+}
+
+/*
+ * Request R is done with the disk; hand it to the next one.
+ */
+static
+void
+lhd_dequeue(struct lhd_softc *lh, struct lhd_request *r, uint32_t done)
+{
+	struct lhd_request *next;
+	struct timespec now, serv;
+	uint64_t ns;
+
+	gettime(&now);
+	timespec_sub(&now, &r->lr_queued, &serv);
+	ns = lhd_ns(&serv);
+
+	lock_acquire(lh->lh_qlock);
+
+	KASSERT(lh->lh_busy);
+	lh->lh_busy = false;
+	lh->lh_depth--;
+	lh->lh_headpos = r->lr_sector + done;
+
+	lh->lh_stats.ls_requests++;
+	lh->lh_stats.ls_sectors += done;
+	lh->lh_stats.ls_servns += ns;
+	if (ns > lh->lh_stats.ls_maxservns) {
+		lh->lh_stats.ls_maxservns = ns;
+	}
+
+	next = lhd_pick(lh);
+	if (next != NULL) {
+		lhd_dispatch(lh, next);
+	}
+
+	lock_release(lh->lh_qlock);
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The request may cover any number of consecutive sectors, and the
+ * uio any number of iovecs (see dev_iovio), so a whole extent is a
+ * single request. The card only has a one-sector buffer and does one
+ * sector per operation, so the sectors still go one at a time, but
+ * the request gets the device once for all of them: they are issued
+ * back to back, in order, without other requests getting in between
+ * and moving the head elsewhere. Concurrent requests queue up and are
+ * ordered by lhd_pick.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request req;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
@@ -194,7 +441,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
 	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -202,8 +449,7 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (len > lh->lh_dev.d_blocks || sector > lh->lh_dev.d_blocks - len) {
 		return EINVAL;
 	}
 
@@ -212,62 +458,73 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/* Wait until it's our turn to use the device. */
+	req.lr_sector = sector;
+	lhd_enqueue(lh, &req);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
+		result = lhd_iosector(lh, sector+i, statval, uio);
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+		/* If we failed, stop. */
+		if (result) {
+			break;
 		}
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	/* Let the next request go ahead. */
+	lhd_dequeue(lh, &req, i);
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	return result;
+}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
+/*
+ * Print the request queue statistics, or clear them.
+ */
+static
+void
+lhd_stats(struct device *d, bool reset)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_stats st;
+	int u = lh->lh_unit;
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	lock_acquire(lh->lh_qlock);
+	st = lh->lh_stats;
+	if (reset) {
+		bzero(&lh->lh_stats, sizeof(lh->lh_stats));
+	}
+	lock_release(lh->lh_qlock);
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
-		}
+	if (reset) {
+		return;
 	}
 
-	return 0;
+	kprintf("lhd%d: %u requests, %u sectors\n",
+		u, st.ls_requests, st.ls_sectors);
+	if (st.ls_requests == 0) {
+		return;
+	}
+	kprintf("lhd%d: queue depth avg %u.%02u, max %u\n", u,
+		st.ls_depthsum / st.ls_requests,
+		st.ls_depthsum * 100 / st.ls_requests % 100,
+		st.ls_maxdepth);
+	kprintf("lhd%d: latency avg %llu us (%llu us queued), "
+		"max %llu us\n", u,
+		(unsigned long long)(st.ls_servns / st.ls_requests / 1000),
+		(unsigned long long)(st.ls_waitns / st.ls_requests / 1000),
+		(unsigned long long)(st.ls_maxservns / 1000));
+	kprintf("lhd%d: %u contiguous, %u by deadline, "
+		"head moved %llu sectors\n", u,
+		st.ls_contiguous, st.ls_deadline,
+		(unsigned long long)st.ls_seek);
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_stats = lhd_stats,
 };
 
 /*
@@ -284,17 +541,32 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
+	/* Create the synchronization objects. */
 	lh->lh_done = sem_create("lhd-done", 0);
 	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
 		return ENOMEM;
 	}
+	lh->lh_qlock = lock_create("lhd-queue");
+	if (lh->lh_qlock == NULL) {
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+	lh->lh_qcv = cv_create("lhd-queue");
+	if (lh->lh_qcv == NULL) {
+		lock_destroy(lh->lh_qlock);
+		lh->lh_qlock = NULL;
+		sem_destroy(lh->lh_done);
+		lh->lh_done = NULL;
+		return ENOMEM;
+	}
+
+	/* Empty request queue. */
+	lh->lh_queue = NULL;
+	lh->lh_depth = 0;
+	lh->lh_busy = false;
+	lh->lh_headpos = 0;
+	bzero(&lh->lh_stats, sizeof(lh->lh_stats));
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
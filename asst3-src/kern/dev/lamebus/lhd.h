@@ -31,12 +31,43 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <kern/time.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A request waiting for (or using) the disk. Requests are queued by
+ * lhd_io, and whichever thread finishes with the disk picks the next
+ * one to go (see lhd_pick) and wakes just that one up, on its own
+ * lr_cv. A request that couldn't get a cv waits on lh_qcv instead.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	struct timespec lr_queued;	/* when it arrived */
+	bool lr_go;			/* chosen; may use the disk */
+	struct cv *lr_cv;		/* for lr_go, or NULL */
+	struct lhd_request *lr_next;	/* queue, in arrival order */
+};
+
+/*
+ * Per-disk request queue statistics.
+ */
+struct lhd_stats {
+	unsigned ls_requests;		/* requests completed */
+	unsigned ls_sectors;		/* sectors transferred */
+	unsigned ls_depthsum;		/* queue depth seen at arrival, summed */
+	unsigned ls_maxdepth;		/* deepest queue seen at arrival */
+	unsigned ls_contiguous;		/* started where the last one ended */
+	unsigned ls_deadline;		/* dispatched out of order for age */
+	uint64_t ls_seek;		/* sectors the head moved between requests */
+	uint64_t ls_waitns;		/* total time queued */
+	uint64_t ls_servns;		/* total time queued + transferring */
+	uint64_t ls_maxservns;		/* longest of those */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -52,8 +83,16 @@ struct lhd_softc {
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct semaphore *lh_done;	/* Synchronization with lhd_irq */
+
+	/* Request queue, protected by lh_qlock */
+	struct lock *lh_qlock;
+	struct cv *lh_qcv;		/* for lr_go, if no lr_cv */
+	struct lhd_request *lh_queue;	/* waiting requests */
+	unsigned lh_depth;		/* waiting requests + the active one */
+	bool lh_busy;			/* a request is using the disk */
+	uint32_t lh_headpos;		/* sector after the last one done */
+	struct lhd_stats lh_stats;
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -36,158 +36,318 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Number of file blocks mapped through one block pointer at each
+ * level of indirection: one for a data block, SFS_DBPERIDB for an
+ * indirect block, and so on up to the triple indirect block.
+ */
+static const uint32_t sfs_levelspan[4] = {
+	1,
+	SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB,
+};
+
+/*
+ * Get the inode's pointer to its indirect block of level LEVEL.
+ */
+static
+uint32_t *
+sfs_toplevel(struct sfs_vnode *sv, unsigned level)
+{
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: Invalid indirection level %u\n", level);
+}
+
+/*
+ * The block map cache: each vnode remembers the last leaf indirect
+ * block (the kind that points at data blocks) it went through, so
+ * that sequential access to a large file reads one indirect block per
+ * lookup instead of walking down from the inode every time.
+ *
+ * Readers look blocks up holding sv_lock only for reading, so they
+ * can race to update the cache; hence the spinlock. Anything that
+ * frees indirect blocks holds sv_lock for writing and clears the
+ * cache first.
+ */
+
+/*
+ * If FILEBLOCK is mapped by the cached leaf, return the leaf and set
+ * *OFFP to FILEBLOCK's slot in it; otherwise return 0.
  */
+static
+daddr_t
+sfs_bmapcache_get(struct sfs_vnode *sv, uint32_t fileblock, uint32_t *offp)
+{
+	daddr_t leaf = 0;
+
+	spinlock_acquire(&sv->sv_bmaplock);
+	if (sv->sv_bmapleaf != 0 && fileblock >= sv->sv_bmapbase &&
+	    fileblock - sv->sv_bmapbase < SFS_DBPERIDB) {
+		leaf = sv->sv_bmapleaf;
+		*offp = fileblock - sv->sv_bmapbase;
+	}
+	spinlock_release(&sv->sv_bmaplock);
+	return leaf;
+}
+
+static
+void
+sfs_bmapcache_set(struct sfs_vnode *sv, uint32_t base, daddr_t leaf)
+{
+	spinlock_acquire(&sv->sv_bmaplock);
+	sv->sv_bmapbase = base;
+	sv->sv_bmapleaf = leaf;
+	spinlock_release(&sv->sv_bmaplock);
+}
+
+/*
+ * Allocate a block for SV, data or indirect, right after the last one
+ * we allocated for it (or right after the inode, if we don't know of
+ * one; see sfs_bmap).
+ */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_alloc(struct sfs_vnode *sv, daddr_t *block)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t goal;
+	int result;
 
+	goal = (sv->sv_lastblock != 0 ? sv->sv_lastblock : sv->sv_ino) + 1;
+	result = sfs_balloc(sfs, goal, block);
+	if (result) {
+		return result;
+	}
+	sv->sv_lastblock = *block;
+	return 0;
+}
+
+/*
+ * Get entry IDX of indirect block IDBLOCK. If DOALLOC is set, and
+ * the entry is empty, allocate a block for it.
+ */
+static
+int
+sfs_bmap_slot(struct sfs_vnode *sv, daddr_t idblock, uint32_t idx,
+	      bool doalloc, daddr_t *ret)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	uint32_t *idbuf;
 	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(idx < SFS_DBPERIDB);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	result = buffer_read(sfs->sfs_device, idblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(iobuf);
 
-	/*
-	 * If the block we want is one of the direct blocks...
-	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
+	block = idbuf[idx];
 
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
-
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		result = sfs_bmap_alloc(sv, &block);
+		if (result) {
+			buffer_release(iobuf);
+			return result;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
-	}
+		/* Remember the block we allocated */
+		idbuf[idx] = block;
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
+		/* The indirect block is now dirty */
+		buffer_mark_dirty(iobuf);
 
-	fileblock -= SFS_NDIRECT;
+		/* (if it's another indirect block, sfs_balloc zeroed it) */
+	}
+	buffer_release(iobuf);
+
+	*ret = block;
+	return 0;
+}
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+/*
+ * Map a block that isn't one of the direct blocks. Figure out which
+ * of the inode's indirect blocks it lives under and walk down from
+ * there to the leaf indirect block.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		  daddr_t *diskblock)
+{
+	uint32_t *ptr;
+	uint32_t offset, idx;
+	unsigned level;
+	daddr_t block;
+	int result;
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Subtract off the blocks mapped by the direct blocks and by
+	 * each smaller level of indirection, so OFFSET is the offset
+	 * into the space mapped by the indirect block we want.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
+	offset = fileblock - SFS_NDIRECT;
+	for (level = 1; level <= 3; level++) {
+		if (offset < sfs_levelspan[level]) {
+			break;
+		}
+		offset -= sfs_levelspan[level];
+	}
+	if (level > 3) {
+		/* Past the end of the triple indirect block */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	ptr = sfs_toplevel(sv, level);
+	block = *ptr;
 
-	if (idblock==0 && !doalloc) {
+	if (block==0 && !doalloc) {
 		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
+		 * Nothing allocated; pretend the indirect block was
+		 * filled with all zeros.
 		 */
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	else if (block==0) {
+		result = sfs_bmap_alloc(sv, &block);
 		if (result) {
 			return result;
 		}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
+		/* Remember the block we just allocated; mark inode dirty */
+		*ptr = block;
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* (sfs_balloc zeroed it in the buffer cache) */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+
+	/* Walk down to the leaf indirect block */
+	while (level > 1) {
+		level--;
+		idx = offset / sfs_levelspan[level];
+		offset %= sfs_levelspan[level];
+
+		result = sfs_bmap_slot(sv, block, idx, doalloc, &block);
 		if (result) {
 			return result;
 		}
+		if (block == 0) {
+			/* Hole, and we weren't asked to fill it */
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
+		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* BLOCK is now the leaf; remember it for next time */
+	sfs_bmapcache_set(sv, fileblock - offset, block);
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	return sfs_bmap_slot(sv, block, offset, doalloc, diskblock);
+}
+
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ *
+ * The caller must hold sv_lock; for writing if DOALLOC is set.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block, leaf;
+	uint32_t idoff;
+	int result;
+
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	/*
+	 * sv_lastblock isn't kept on disk, so after the inode is
+	 * loaded it's 0 and the next allocation would go back to the
+	 * inode. If we're about to allocate, take the goal from the
+	 * file's previous block instead, so appending to an existing
+	 * file stays next to its data. This has to be done here,
+	 * before any indirect block is held.
+	 */
+	if (doalloc && sv->sv_lastblock == 0 && fileblock > 0) {
+		result = sfs_bmap(sv, fileblock, false, &block);
+		if (result) {
+			return result;
+		}
+		if (block != 0) {
+			/* already there; nothing to allocate */
+			*diskblock = block;
+			return 0;
+		}
+		result = sfs_bmap(sv, fileblock - 1, false, &block);
 		if (result) {
 			return result;
 		}
+		sv->sv_lastblock = block;
+	}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	/*
+	 * If the block we want is one of the direct blocks...
+	 */
+	if (fileblock < SFS_NDIRECT) {
+		/*
+		 * Get the block number
+		 */
+		block = sv->sv_i.sfi_direct[fileblock];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/*
+		 * Do we need to allocate?
+		 */
+		if (block==0 && doalloc) {
+			result = sfs_bmap_alloc(sv, &block);
+			if (result) {
+				return result;
+			}
+
+			/* Remember what we allocated; mark inode dirty */
+			sv->sv_i.sfi_direct[fileblock] = block;
+			sv->sv_dirty = true;
+		}
+	}
+	else {
+		/*
+		 * It's behind one or more indirect blocks. Try the
+		 * cached leaf before walking down from the inode.
+		 */
+		leaf = sfs_bmapcache_get(sv, fileblock, &idoff);
+		if (leaf != 0) {
+			result = sfs_bmap_slot(sv, leaf, idoff, doalloc,
+					       &block);
+		}
+		else {
+			result = sfs_bmap_indirect(sv, fileblock, doalloc,
+						   &block);
+		}
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
+	/*
+	 * Hand back the block
+	 */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: %s: Data block %u (block %u of file %u) "
 		      "marked free\n", sfs->sfs_sb.sb_volname,
@@ -198,34 +358,109 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard everything under the indirect block *BLOCKP, which is of
+ * level LEVEL and maps file blocks starting at BASE, that lies past
+ * the new end of file BLOCKLEN. If that leaves the indirect block
+ * empty, free it too, clear *BLOCKP, and set *CHANGEDP.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *blockp, unsigned level,
+		    uint32_t base, uint32_t blocklen, bool *changedp)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *iobuf;
+	uint32_t *idbuf;
+	uint32_t j, childbase;
+	bool hasnonzero, iddirty, childchanged;
+	int result;
+
+	if (*blockp == 0 || base + sfs_levelspan[level] <= blocklen) {
+		/* Nothing here, or all of it is before the new EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, *blockp, &iobuf);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(iobuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		childbase = base + j * sfs_levelspan[level-1];
+
+		if (level > 1) {
+			/* Recurse into the next level down */
+			childchanged = false;
+			result = sfs_itrunc_indirect(sfs, &idbuf[j], level-1,
+						     childbase, blocklen,
+						     &childchanged);
+			if (childchanged) {
+				iddirty = true;
+			}
+			if (result) {
+				if (iddirty) {
+					buffer_mark_dirty(iobuf);
+				}
+				buffer_release(iobuf);
+				return result;
+			}
+		}
+		else if (blocklen <= childbase && idbuf[j] != 0) {
+			/* Discard data blocks that are past the new EOF */
+			sfs_bfree(sfs, idbuf[j]);
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/*
+		 * The whole indirect block is empty now; free it,
+		 * and don't bother writing it back.
+		 */
+		buffer_release_and_invalidate(iobuf);
+		sfs_bfree(sfs, *blockp);
+		*blockp = 0;
+		*changedp = true;
+	}
+	else {
+		/* If the indirect block is dirty, it gets written back */
+		if (iddirty) {
+			buffer_mark_dirty(iobuf);
+		}
+		buffer_release(iobuf);
+	}
+	return 0;
+}
 
+/*
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * sv_lock for writing, or own the vnode outright.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i, base;
+	unsigned level;
+	daddr_t block;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	/* The cached leaf may be about to go away */
+	sfs_bmapcache_set(sv, 0, 0);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,55 +475,19 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+	/* Then the single, double, and triple indirect blocks */
+	base = SFS_NDIRECT;
+	for (level = 1; level <= 3; level++) {
+		changed = false;
+		result = sfs_itrunc_indirect(sfs, sfs_toplevel(sv, level),
+					     level, base, blocklen, &changed);
+		if (changed) {
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		if (result) {
+			return result;
 		}
+		base += sfs_levelspan[level];
 	}
 
 	/* Set the file size */
@@ -297,7 +496,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
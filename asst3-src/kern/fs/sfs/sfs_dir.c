@@ -35,10 +35,16 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * All of these expect the caller to hold the directory's sv_lock:
+ * for reading to look things up, for writing to change entries.
+ */
+
 /*
  * Read the directory entry out of slot SLOT of a directory vnode.
  * The "slot" is the index of the directory entry, starting at 0.
@@ -95,6 +101,263 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Name index
+//
+// A directory's entries are indexed in memory by name the first time
+// it is searched, so later lookups needn't read and compare every
+// slot. The index is kept up to date by sfs_dir_link and
+// sfs_dir_unlink; if updating it fails we throw it away and build it
+// again next time. It also tracks the empty slots.
+
+/* Starting number of hash chains; doubled as the directory grows */
+#define SFS_DIRHASH_MINSIZE 16
+
+struct sfs_dirent {
+	char *de_name;			/* name, or NULL for an empty slot */
+	uint32_t de_ino;		/* inode number */
+	int de_slot;			/* slot in the directory */
+	uint32_t de_hash;		/* hash of de_name */
+	struct sfs_dirent *de_next;	/* hash chain or empty-slot list */
+};
+
+struct sfs_dirhash {
+	struct sfs_dirent **dh_table;	/* hash chains of named entries */
+	unsigned dh_size;		/* number of chains */
+	unsigned dh_count;		/* number of named entries */
+	struct sfs_dirent *dh_empty;	/* entries for empty slots */
+};
+
+static
+uint32_t
+sfs_dir_namehash(const char *name)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static
+void
+sfs_dirent_destroy(struct sfs_dirent *de)
+{
+	if (de->de_name != NULL) {
+		kfree(de->de_name);
+	}
+	kfree(de);
+}
+
+/*
+ * Throw away a directory's name index, if it has one.
+ */
+void
+sfs_dir_hashdestroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh = sv->sv_dirhash;
+	struct sfs_dirent *de;
+	unsigned i;
+
+	if (dh == NULL) {
+		return;
+	}
+	for (i=0; i<dh->dh_size; i++) {
+		while ((de = dh->dh_table[i]) != NULL) {
+			dh->dh_table[i] = de->de_next;
+			sfs_dirent_destroy(de);
+		}
+	}
+	while ((de = dh->dh_empty) != NULL) {
+		dh->dh_empty = de->de_next;
+		sfs_dirent_destroy(de);
+	}
+	kfree(dh->dh_table);
+	kfree(dh);
+	sv->sv_dirhash = NULL;
+}
+
+/*
+ * Double the number of hash chains. If we can't get the memory, the
+ * chains just stay longer.
+ */
+static
+void
+sfs_dirhash_grow(struct sfs_dirhash *dh)
+{
+	struct sfs_dirent **table, *de;
+	unsigned size, i, h;
+
+	size = dh->dh_size * 2;
+	table = kmalloc(size * sizeof(table[0]));
+	if (table == NULL) {
+		return;
+	}
+	for (i=0; i<size; i++) {
+		table[i] = NULL;
+	}
+	for (i=0; i<dh->dh_size; i++) {
+		while ((de = dh->dh_table[i]) != NULL) {
+			dh->dh_table[i] = de->de_next;
+			h = de->de_hash % size;
+			de->de_next = table[h];
+			table[h] = de;
+		}
+	}
+	kfree(dh->dh_table);
+	dh->dh_table = table;
+	dh->dh_size = size;
+}
+
+/*
+ * Add an entry. NAME is NULL for an empty slot.
+ */
+static
+int
+sfs_dirhash_add(struct sfs_dirhash *dh, const char *name, uint32_t ino,
+		int slot)
+{
+	struct sfs_dirent *de;
+	unsigned h;
+
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_ino = ino;
+	de->de_slot = slot;
+
+	if (name == NULL) {
+		de->de_name = NULL;
+		de->de_hash = 0;
+		de->de_next = dh->dh_empty;
+		dh->dh_empty = de;
+		return 0;
+	}
+
+	de->de_name = kstrdup(name);
+	if (de->de_name == NULL) {
+		kfree(de);
+		return ENOMEM;
+	}
+	de->de_hash = sfs_dir_namehash(name);
+
+	if (dh->dh_count >= 2 * dh->dh_size) {
+		sfs_dirhash_grow(dh);
+	}
+	h = de->de_hash % dh->dh_size;
+	de->de_next = dh->dh_table[h];
+	dh->dh_table[h] = de;
+	dh->dh_count++;
+	return 0;
+}
+
+/*
+ * Find the entry for NAME. If PREVP isn't NULL, hand back the link
+ * that points to it, for removing it.
+ */
+static
+struct sfs_dirent *
+sfs_dirhash_find(struct sfs_dirhash *dh, const char *name,
+		 struct sfs_dirent ***prevp)
+{
+	struct sfs_dirent *de, **pp;
+	uint32_t hash;
+
+	hash = sfs_dir_namehash(name);
+	for (pp = &dh->dh_table[hash % dh->dh_size]; (de = *pp) != NULL;
+	     pp = &de->de_next) {
+		if (de->de_hash == hash && !strcmp(de->de_name, name)) {
+			if (prevp != NULL) {
+				*prevp = pp;
+			}
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Build the name index for a directory, reading it a block at a time.
+ * The caller must hold sv_lock for writing.
+ */
+int
+sfs_dir_hashload(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh;
+	struct sfs_direntry *sds;
+	unsigned perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+	int nentries, i, result;
+	unsigned j;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	if (sv->sv_dirhash != NULL) {
+		/* somebody beat us to it */
+		return 0;
+	}
+
+	dh = kmalloc(sizeof(*dh));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	dh->dh_size = SFS_DIRHASH_MINSIZE;
+	dh->dh_count = 0;
+	dh->dh_empty = NULL;
+	dh->dh_table = kmalloc(dh->dh_size * sizeof(dh->dh_table[0]));
+	if (dh->dh_table == NULL) {
+		kfree(dh);
+		return ENOMEM;
+	}
+	for (j=0; j<dh->dh_size; j++) {
+		dh->dh_table[j] = NULL;
+	}
+	/* install it now so sfs_dir_hashdestroy can clean up on error */
+	sv->sv_dirhash = dh;
+
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		sfs_dir_hashdestroy(sv);
+		return ENOMEM;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i += perblock) {
+		result = sfs_metaio(sv, i * sizeof(struct sfs_direntry),
+				    sds, SFS_BLOCKSIZE, UIO_READ);
+		if (result) {
+			goto fail;
+		}
+		for (j=0; j<perblock && i+j < (unsigned)nentries; j++) {
+			if (sds[j].sfd_ino == SFS_NOINO) {
+				result = sfs_dirhash_add(dh, NULL, 0, i+j);
+			}
+			else {
+				/* Ensure null termination, just in case */
+				sds[j].sfd_name[sizeof(sds[j].sfd_name)-1] = 0;
+				result = sfs_dirhash_add(dh, sds[j].sfd_name,
+							 sds[j].sfd_ino, i+j);
+			}
+			if (result) {
+				goto fail;
+			}
+		}
+	}
+
+	kfree(sds);
+	return 0;
+
+ fail:
+	kfree(sds);
+	sfs_dir_hashdestroy(sv);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -105,8 +368,36 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
+	struct sfs_dirent *de;
 	int found, nentries, i, result;
 
+	/*
+	 * Build the name index if we can. That changes the vnode, so
+	 * it needs the write lock; sfs_lookup, which only holds the
+	 * read lock, sees to it beforehand.
+	 */
+	if (sv->sv_dirhash == NULL && rwlock_do_i_hold_write(sv->sv_lock)) {
+		/* if this fails, fall back to searching the slow way */
+		(void)sfs_dir_hashload(sv);
+	}
+
+	if (sv->sv_dirhash != NULL) {
+		if (emptyslot != NULL && sv->sv_dirhash->dh_empty != NULL) {
+			*emptyslot = sv->sv_dirhash->dh_empty->de_slot;
+		}
+		de = sfs_dirhash_find(sv->sv_dirhash, name, NULL);
+		if (de == NULL) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = de->de_slot;
+		}
+		if (ino != NULL) {
+			*ino = de->de_ino;
+		}
+		return 0;
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -186,7 +477,28 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the name index */
+	if (sv->sv_dirhash != NULL) {
+		struct sfs_dirent *de, **pp;
+
+		for (pp = &sv->sv_dirhash->dh_empty; (de = *pp) != NULL;
+		     pp = &de->de_next) {
+			if (de->de_slot == emptyslot) {
+				*pp = de->de_next;
+				sfs_dirent_destroy(de);
+				break;
+			}
+		}
+		if (sfs_dirhash_add(sv->sv_dirhash, name, ino, emptyslot)) {
+			sfs_dir_hashdestroy(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -195,14 +507,41 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_direntry sd, oldsd;
+	struct sfs_dirent *de, **pp;
+	int result;
+
+	/* Get the old name, to find it in the name index */
+	if (sv->sv_dirhash != NULL) {
+		result = sfs_readdir(sv, slot, &oldsd);
+		if (result) {
+			return result;
+		}
+		oldsd.sfd_name[sizeof(oldsd.sfd_name)-1] = 0;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* The index entry becomes an empty slot */
+	if (sv->sv_dirhash != NULL) {
+		de = sfs_dirhash_find(sv->sv_dirhash, oldsd.sfd_name, &pp);
+		KASSERT(de != NULL && de->de_slot == slot);
+		*pp = de->de_next;
+		sv->sv_dirhash->dh_count--;
+		kfree(de->de_name);
+		de->de_name = NULL;
+		de->de_next = sv->sv_dirhash->dh_empty;
+		sv->sv_dirhash->dh_empty = de;
+	}
+	return 0;
 }
 
 /*
@@ -228,11 +567,17 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	if (*ret != sv) {
+		rwlock_acquire_read((*ret)->sv_lock);
+	}
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: %s: name %s (inode %u) in dir %u has "
 		      "linkcount 0\n", sfs->sfs_sb.sb_volname,
 		      name, (*ret)->sv_ino, sv->sv_ino);
 	}
+	if (*ret != sv) {
+		rwlock_release_read((*ret)->sv_lock);
+	}
 
 	return 0;
 }
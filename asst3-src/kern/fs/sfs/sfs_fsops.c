@@ -38,9 +38,11 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -107,38 +109,88 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 /*
  * Sync routine for the vnode table.
+ *
+ * Writing an inode needs the vnode's own lock, which comes before the
+ * table lock, so we can't sync while holding the table. Take
+ * references to everything in it instead, then sync and drop them
+ * unlocked. This only writes the inodes to the buffer cache; unlike
+ * VOP_FSYNC it leaves the freemap and the device flush to sfs_sync,
+ * which does each once for the whole volume.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct sfs_vnode *sv;
+	struct vnode *v;
 	unsigned i, num;
+	int result, ret = 0;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	result = vnodearray_preallocate(vnodes, sfs->sfs_nvnodes);
+	if (result) {
+		rwlock_release_read(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			/* (idle vnodes were synced when they went idle) */
+			if (sv->sv_idle) {
+				continue;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+			/* can't fail; preallocated */
+			vnodearray_add(vnodes, &sv->sv_absvn, NULL);
+		}
+	}
+	rwlock_release_read(sfs->sfs_vnlock);
+	num = vnodearray_num(vnodes);
+
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+		rwlock_acquire_write(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+		if (result && ret == 0) {
+			/* keep going; report the first failure */
+			ret = result;
+		}
+		VOP_DECREF(v);
 	}
-	return 0;
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return ret;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Also used by sfs_fsync.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +204,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +229,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +264,27 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/* All of the above only went to the buffer cache; flush it. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +298,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes while mounted; no lock needed */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +313,10 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	rwlock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_renamelock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -278,11 +332,12 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. Vnodes that
+	 * are merely cached don't count; unload those first. (The VFS
+	 * layer holds the device list locked here, so no new opens can begin.)
+	 */
+	if (sfs_vnode_flushidle(sfs) > 0) {
 		return EBUSY;
 	}
 
@@ -290,6 +345,9 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Forget our cached blocks; sfs_sync wrote them all back */
+	buffer_drop(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +355,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +378,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -350,18 +408,38 @@ sfs_fs_create(void)
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
-	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	/* vnode tables */
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_idlehead = sfs->sfs_idletail = NULL;
+	sfs->sfs_nidle = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	/* locks */
+	sfs->sfs_vnlock = rwlock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_renamelock = lock_create("sfs_renamelock");
+	if (sfs->sfs_renamelock == NULL) {
+		goto cleanup_freemaplock;
+	}
+
 	return sfs;
 
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_vnlock:
+	rwlock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +466,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +478,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +485,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -421,9 +495,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		buffer_drop(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -434,9 +508,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		buffer_drop(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -451,23 +525,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		buffer_drop(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		buffer_drop(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,13 +35,15 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to disk. The caller must
+ * hold sv_lock for writing, or own the vnode outright (sfs_reclaim).
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -60,9 +62,182 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Vnode tables
+//
+// All of these are called with sfs_vnlock held; the ones that change
+// the tables need it held for writing.
+
+/*
+ * Hash an inode number. Inode numbers are block numbers and files
+ * created together tend to have nearby ones, so the low bits will do.
+ */
+static
+unsigned
+sfs_vnhash(uint32_t ino)
+{
+	return ino % SFS_VNHASH_SIZE;
+}
+
+/*
+ * Find a loaded vnode by inode number.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = sfs_vnhash(sv->sv_ino);
+
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	for (pp = &sfs->sfs_vnhash[sfs_vnhash(sv->sv_ino)]; *pp != sv;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
+		}
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Put a vnode at the head (most recently used end) of the idle list.
+ */
+static
+void
+sfs_idle_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_idle);
+	sv->sv_idleprev = NULL;
+	sv->sv_idlenext = sfs->sfs_idlehead;
+	if (sfs->sfs_idlehead != NULL) {
+		sfs->sfs_idlehead->sv_idleprev = sv;
+	}
+	else {
+		sfs->sfs_idletail = sv;
+	}
+	sfs->sfs_idlehead = sv;
+	sv->sv_idle = true;
+	sfs->sfs_nidle++;
+}
+
+static
+void
+sfs_idle_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_idle);
+	if (sv->sv_idleprev != NULL) {
+		sv->sv_idleprev->sv_idlenext = sv->sv_idlenext;
+	}
+	else {
+		sfs->sfs_idlehead = sv->sv_idlenext;
+	}
+	if (sv->sv_idlenext != NULL) {
+		sv->sv_idlenext->sv_idleprev = sv->sv_idleprev;
+	}
+	else {
+		sfs->sfs_idletail = sv->sv_idleprev;
+	}
+	sv->sv_idlenext = sv->sv_idleprev = NULL;
+	sv->sv_idle = false;
+	KASSERT(sfs->sfs_nidle > 0);
+	sfs->sfs_nidle--;
+}
+
+/*
+ * Unload a vnode that nobody else holds: take it out of the tables
+ * and free it.
+ */
+static
+void
+sfs_vnode_destroy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_idle);
+	sfs_vnhash_remove(sfs, sv);
+	sfs_dir_hashdestroy(sv);
+	vnode_cleanup(&sv->sv_absvn);
+	spinlock_cleanup(&sv->sv_bmaplock);
+	spinlock_cleanup(&sv->sv_ralock);
+	rwlock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
+/*
+ * Unload idle vnodes, least recently used first, until no more than
+ * MAX are left. An idle vnode holds only its own reference, and
+ * nobody can get another without going through sfs_loadvnode, which
+ * takes it off the idle list first.
+ */
+static
+void
+sfs_idle_trim(struct sfs_fs *sfs, unsigned max)
+{
+	struct sfs_vnode *sv;
+
+	while (sfs->sfs_nidle > max) {
+		sv = sfs->sfs_idletail;
+
+		/* It was synced when it went idle and nobody's touched it */
+		KASSERT(!sv->sv_dirty);
+		sfs_idle_remove(sfs, sv);
+		sfs_vnode_destroy(sfs, sv);
+	}
+}
+
+/*
+ * Unload all the idle vnodes, for unmount. Returns the number of
+ * vnodes still loaded.
+ */
+unsigned
+sfs_vnode_flushidle(struct sfs_fs *sfs)
+{
+	unsigned ret;
+
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	sfs_idle_trim(sfs, 0);
+	ret = sfs->sfs_nvnodes;
+	rwlock_release_write(sfs->sfs_vnlock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
+ * If the file still exists on disk, the vnode stays loaded on the
+ * idle list, holding the last reference itself, until it's wanted
+ * again or pushed out by newer idle vnodes.
+ *
  * This function should try to avoid returning errors other than EBUSY.
  */
 int
@@ -70,15 +245,17 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode from handing
+	 * out new references while we work.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,16 +265,22 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		rwlock_release_write(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Ours was the last reference and nobody can get another, so
+	 * the vnode is ours alone and sv_lock isn't needed.
+	 */
+	KASSERT(!sv->sv_idle);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -105,38 +288,25 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	if (sv->sv_i.sfi_linkcount > 0) {
+		/* Keep it around in case it's used again soon. */
+		sfs_idle_add(sfs, sv);
+		sfs_idle_trim(sfs, SFS_IDLEMAX);
+		rwlock_release_write(sfs->sfs_vnlock);
+		return 0;
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	/* No on-disk references, so discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
-	vnode_cleanup(&sv->sv_absvn);
+	/* Remove the vnode structure from the tables and free it. */
+	sfs_vnode_destroy(sfs, sv);
 
-	vfs_biglock_release();
-
-	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	rwlock_release_write(sfs->sfs_vnlock);
 
 	/* Done */
 	return 0;
@@ -150,42 +320,69 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Most loads find the vnode already in use by someone else and
+	 * only need another reference, which doesn't change the tables,
+	 * so try that with the table locked for reading first. That way
+	 * lookups of busy files (the root directory, above all) don't
+	 * line up behind each other.
+	 */
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL && !sv->sv_idle) {
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+		VOP_INCREF(&sv->sv_absvn);
+		rwlock_release_read(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
+	}
+	rwlock_release_read(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	rwlock_acquire_write(sfs->sfs_vnlock);
 
+	/* Look again; it may have been loaded while we were unlocked */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_idle) {
+			/* Take over the reference the idle list held */
+			sfs_idle_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
 		}
+		rwlock_release_write(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
-	/* Didn't have it loaded; load it */
+	/*
+	 * Didn't have it loaded; load it. We keep the table locked
+	 * throughout so nobody else loads a second copy meanwhile.
+	 */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		rwlock_release_write(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -198,13 +395,32 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* Directories get their name index when first searched */
+	sv->sv_dirhash = NULL;
+
+	/* No allocation history yet; sfs_bmap recovers it on demand */
+	sv->sv_lastblock = 0;
+
+	/* Nothing in the block map cache yet */
+	spinlock_init(&sv->sv_bmaplock);
+	sv->sv_bmapbase = 0;
+	sv->sv_bmapleaf = 0;
+
+	/* Reading from the start counts as sequential */
+	spinlock_init(&sv->sv_ralock);
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -235,20 +451,23 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		spinlock_cleanup(&sv->sv_bmaplock);
+		spinlock_cleanup(&sv->sv_ralock);
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		rwlock_release_write(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_idlenext = sv->sv_idleprev = NULL;
+	sv->sv_idle = false;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_insert(sfs, sv);
+
+	rwlock_release_write(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -256,20 +475,23 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object in the directory whose inode is
+ * PARENTINO and hand back its vnode.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t parentino,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * near its directory.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, parentino, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +518,21 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* (the type never changes, so this needs no lock) */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
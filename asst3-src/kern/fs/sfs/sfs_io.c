@@ -38,6 +38,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,85 +51,53 @@
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
  * except sfs_device.
+ *
+ * Both go through the buffer cache, copying the block in or out.
+ * Code that only needs part of a block should use the buffer
+ * directly (buffer_read and friends) instead.
  */
 
-/*
- * Read or write a block, retrying I/O errors.
- */
-static
-int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
-{
-	int result;
-	int tries=0;
-
-	KASSERT(vfs_biglock_do_i_hold());
-
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
-
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
-	}
-	return result;
-}
-
 /*
  * Read a block.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. It reaches the disk when the buffer is written back
+ * (on eviction, or at the latest by sfs_sync).
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	buffer_mark_valid(buf);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +119,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +130,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +142,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache. (Even for a write, we
+	 * need the rest of the block.)
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)buffer_map(iobuf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is now dirty (even if the
+	 * uiomove failed partway); it gets written back later.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -228,14 +182,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -258,31 +209,124 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache, so it never holds a stale copy
+	 * of the block. A write overwrites the whole block, so there's
+	 * no need to read it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (result) {
+		if (uio->uio_rw == UIO_WRITE) {
+			/* only partly overwritten; forget the old contents */
+			buffer_release_and_invalidate(iobuf);
+		}
+		else {
+			buffer_release(iobuf);
+		}
+		return result;
+	}
 
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		buffer_mark_valid(iobuf);
+		buffer_mark_dirty(iobuf);
+	}
+	buffer_release(iobuf);
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	return 0;
+}
 
-	return result;
+/*
+ * Read-ahead.
+ *
+ * Each vnode remembers where the last read ended. A read that starts
+ * there is sequential and doubles the read-ahead window, up to
+ * SFS_RAMAX blocks; a read anywhere else closes the window. The
+ * blocks in the window are handed to the buffer cache to read in the
+ * background. To keep the requests reasonably large, more are asked
+ * for only once less than half a window is left in hand.
+ *
+ * The rest of a multi-block read is always handed over as well, so
+ * it goes to the disk as one request while we wait for the first
+ * block, rather than one request per block.
+ *
+ * The caller holds sv_lock, at least for reading.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, const struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t first, last, fileblocks, start, end, fileblock;
+	daddr_t block, runstart = 0;
+	unsigned runlen = 0;
+
+	KASSERT(uio->uio_resid > 0);
+	first = uio->uio_offset / SFS_BLOCKSIZE;
+	last = (uio->uio_offset + uio->uio_resid - 1) / SFS_BLOCKSIZE;
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+
+	spinlock_acquire(&sv->sv_ralock);
+	if (first == sv->sv_ranext) {
+		/* Sequential; open the window further */
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else if (first + 1 != sv->sv_ranext) {
+		/* Not continuing in the last block read either; random */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	start = first + 1;
+	end = last + 1;
+	if (sv->sv_rawindow > 0 &&
+	    sv->sv_raend < end + sv->sv_rawindow / 2) {
+		end += sv->sv_rawindow;
+	}
+	if (start < sv->sv_raend) {
+		start = sv->sv_raend;
+	}
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+	if (end > sv->sv_raend) {
+		sv->sv_raend = end;
+	}
+	spinlock_release(&sv->sv_ralock);
+
+	/* Hand over the blocks in runs of consecutive disk blocks */
+	for (fileblock = start; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &block)) {
+			break;
+		}
+		if (block == 0) {
+			/* hole; nothing to read */
+			continue;
+		}
+		if (runlen > 0 && block == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		buffer_readahead(sfs->sfs_device, runstart, runlen);
+		runstart = block;
+		runlen = 1;
+	}
+	buffer_readahead(sfs->sfs_device, runstart, runlen);
 }
 
 /*
@@ -317,6 +361,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio);
+		}
 	}
 
 	/*
@@ -407,6 +455,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *metaiobuf;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,18 +464,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,26 +484,25 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	metaiobuf = buffer_map(iobuf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
 		memcpy(data, metaiobuf + blockoffset, len);
+		buffer_release(iobuf);
 	}
 	else {
 		/* Update the selected region */
 		memcpy(metaiobuf + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* It gets written back later */
+		buffer_mark_dirty(iobuf);
+		buffer_release(iobuf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
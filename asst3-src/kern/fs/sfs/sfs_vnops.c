@@ -37,8 +37,11 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
+#include <vm.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -90,8 +93,137 @@ sfs_eachopendir(struct vnode *v, int openflags)
 	return 0;
 }
 
+/*
+ * Reads and writes of user memory are staged through a kernel buffer,
+ * a page at a time, so that the user memory is never touched while
+ * holding sv_lock. Touching it can take a page fault that reads the
+ * page in from the program's executable, which may be this very file
+ * (and sv_lock isn't recursive) or another one whose lock someone
+ * waiting on ours holds. Each chunk is done under the lock on its
+ * own, so a large write from user space isn't atomic with respect to
+ * other writers.
+ *
+ * The bounce pages are kept on a small free list once allocated, so
+ * the I/O path normally gets one with just a spinlock. If there's no
+ * page to be had, fall back to a block-sized buffer from the small
+ * object heap rather than failing.
+ */
+#define SFS_BOUNCESIZE PAGE_SIZE
+#define SFS_BOUNCEKEEP 8                /* spare bounce pages kept */
+
+static struct spinlock sfs_bouncelock = SPINLOCK_INITIALIZER;
+static void *sfs_bouncepages[SFS_BOUNCEKEEP];
+static unsigned sfs_nbounce;
+
+static
+void *
+sfs_bounce_get(size_t *size)
+{
+	void *buf = NULL;
+
+	spinlock_acquire(&sfs_bouncelock);
+	if (sfs_nbounce > 0) {
+		buf = sfs_bouncepages[--sfs_nbounce];
+	}
+	spinlock_release(&sfs_bouncelock);
+
+	if (buf == NULL) {
+		buf = kmalloc(SFS_BOUNCESIZE);
+	}
+	if (buf != NULL) {
+		*size = SFS_BOUNCESIZE;
+		return buf;
+	}
+
+	*size = SFS_BLOCKSIZE;
+	return kmalloc(SFS_BLOCKSIZE);
+}
+
+static
+void
+sfs_bounce_put(void *buf, size_t size)
+{
+	if (size == SFS_BOUNCESIZE) {
+		spinlock_acquire(&sfs_bouncelock);
+		if (sfs_nbounce < SFS_BOUNCEKEEP) {
+			sfs_bouncepages[sfs_nbounce++] = buf;
+			buf = NULL;
+		}
+		spinlock_release(&sfs_bouncelock);
+	}
+	if (buf != NULL) {
+		kfree(buf);
+	}
+}
+
+static
+int
+sfs_bounceio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t bufsize, len, done;
+	int result = 0, result2;
+
+	buf = sfs_bounce_get(&bufsize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > bufsize) {
+			len = bufsize;
+		}
+		uio_kinit(&iov, &ku, buf, len, uio->uio_offset, uio->uio_rw);
+
+		if (uio->uio_rw == UIO_READ) {
+			rwlock_acquire_read(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_read(sv->sv_lock);
+
+			/* hand over whatever we got, even on error */
+			done = len - ku.uio_resid;
+			result2 = uiomove(buf, done, uio);
+			if (result == 0) {
+				result = result2;
+			}
+			if (result || ku.uio_resid > 0) {
+				/* error or EOF */
+				break;
+			}
+		}
+		else {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+
+			/* Don't pile up more dirty buffers than the cache wants */
+			buffer_throttle();
+
+			rwlock_acquire_write(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_write(sv->sv_lock);
+
+			if (result) {
+				/* don't count what didn't reach the file */
+				uio->uio_resid += ku.uio_resid;
+				uio->uio_offset -= ku.uio_resid;
+				break;
+			}
+		}
+	}
+
+	sfs_bounce_put(buf, bufsize);
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
+ *
+ * Reads of the same file only need the vnode lock shared.
  */
 static
 int
@@ -102,9 +234,13 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_bounceio(sv, uio);
+	}
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -121,9 +257,16 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_bounceio(sv, uio);
+	}
+
+	/* Don't pile up more dirty buffers than the cache wants */
+	buffer_throttle();
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -164,8 +307,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -177,6 +322,8 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type is fixed when the vnode is loaded, so no lock is needed.
  */
 static
 int
@@ -185,16 +332,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -222,13 +365,32 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/*
+	 * Blocks the file has gained are only marked in the in-memory
+	 * freemap; get that into the buffer cache as well.
+	 */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * The inode and the file's blocks may still be sitting dirty
+	 * in the buffer cache; push them out too. (This writes back
+	 * the whole device's dirty buffers, which is more than needed
+	 * but simple.)
+	 */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
@@ -250,8 +412,13 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	rwlock_release_write(sv->sv_lock);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,37 +456,40 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Lock the directory for writing throughout, so nobody else
+	 * can create the same name between our lookup and our link.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		rwlock_release_write(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -329,20 +499,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_lock);
 
-	*ret = &newguy->sv_absvn;
+	rwlock_release_write(sv->sv_lock);
 
-	vfs_biglock_release();
+	*ret = &newguy->sv_absvn;
 	return 0;
 }
 
@@ -361,26 +533,27 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	rwlock_release_write(f->sv_lock);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -396,12 +569,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -409,18 +582,54 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_lock);
 	}
 
+	rwlock_release_write(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Lock the directories for a rename: the lower-numbered inode first,
+ * so two renames between the same pair of directories can't each
+ * hold one and wait for the other. The caller holds sfs_renamelock,
+ * which keeps the tree shape from changing under us.
+ */
+static
+void
+sfs_rename_lockdirs(struct sfs_vnode *sd1, struct sfs_vnode *sd2)
+{
+	if (sd1 == sd2) {
+		rwlock_acquire_write(sd1->sv_lock);
+	}
+	else if (sd1->sv_ino < sd2->sv_ino) {
+		rwlock_acquire_write(sd1->sv_lock);
+		rwlock_acquire_write(sd2->sv_lock);
+	}
+	else {
+		rwlock_acquire_write(sd2->sv_lock);
+		rwlock_acquire_write(sd1->sv_lock);
+	}
+}
+
+static
+void
+sfs_rename_unlockdirs(struct sfs_vnode *sd1, struct sfs_vnode *sd2)
+{
+	rwlock_release_write(sd1->sv_lock);
+	if (sd2 != sd1) {
+		rwlock_release_write(sd2->sv_lock);
+	}
+}
+
 /*
  * Rename a file.
  *
@@ -438,21 +647,26 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	lock_acquire(sfs->sfs_renamelock);
+	sfs_rename_lockdirs(sv, d2->vn_data);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_rename_unlockdirs(sv, d2->vn_data);
+		lock_release(sfs->sfs_renamelock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	/* Files come after directories in the lock order. */
+	rwlock_acquire_write(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -484,10 +698,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	rwlock_release_write(g1->sv_lock);
+	sfs_rename_unlockdirs(sv, d2->vn_data);
+	lock_release(sfs->sfs_renamelock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -505,9 +722,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	rwlock_release_write(g1->sv_lock);
+	sfs_rename_unlockdirs(sv, d2->vn_data);
+	lock_release(sfs->sfs_renamelock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -525,15 +745,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +757,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +774,31 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	/* Lookups in the same directory can run side by side. */
+	rwlock_acquire_read(sv->sv_lock);
+	if (sv->sv_dirhash == NULL) {
+		/*
+		 * First search of this directory: build its name index,
+		 * which needs the lock exclusively. If that fails,
+		 * sfs_dir_findname searches the slow way instead.
+		 */
+		rwlock_release_read(sv->sv_lock);
+		rwlock_acquire_write(sv->sv_lock);
+		(void)sfs_dir_hashload(sv);
+		rwlock_release_write(sv->sv_lock);
+		rwlock_acquire_read(sv->sv_lock);
+	}
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
-
-	vfs_biglock_release();
 	return 0;
 }
 
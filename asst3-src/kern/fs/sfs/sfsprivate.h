@@ -43,7 +43,7 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
@@ -53,6 +53,8 @@ int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
+int sfs_dir_hashload(struct sfs_vnode *sv);
+void sfs_dir_hashdestroy(struct sfs_vnode *sv);
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
@@ -62,12 +64,17 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
+unsigned sfs_vnode_flushidle(struct sfs_fs *sfs);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t parentino,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
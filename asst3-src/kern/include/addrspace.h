@@ -35,7 +35,9 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -56,10 +58,19 @@ struct region {
     int read;                   //read permission of the region
     int write;                  //write permission of the region
     int execute;                //execute permission of the region
-    int old_write;              //old write permission of the region for as_prepare load
-    struct region* next;        //pointer to the next region
+    struct vnode *vn;           //backing executable, NULL for anonymous memory
+    vaddr_t filebase;           //virtual address where the file data starts
+    off_t fileoff;              //offset of that data in the file
+    size_t filesz;              //bytes backed by the file; the rest is zero-fill
 };
 
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -72,14 +83,26 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         
-        /* linked list of regions */
-        struct region *regions;
+        /* regions, sorted by vbase */
+        struct regionarray regions;
+
+        /* region of the last region_mapping hit, NULL if none */
+        struct region *as_lasthit;
+
+        /* first pagetable slot on this space's list of pages, or -1 */
+        int as_pages;
+
+        /* per-cpu ASID (generation << 6 | asid), 0 if none; see vm.c */
+        uint32_t as_asid[MAXCPUS];
 #endif
 };
 
 /*
  * Functions in addrspace.c:
  *
+ *    as_bootstrap - set up address space allocation. Called once from
+ *                vm_bootstrap.
+ *
  *    as_create - create a new empty address space. You need to make
  *                sure this gets called in all the right places. You
  *                may find you want to change the argument list. May
@@ -104,6 +127,10 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_backing - record that part of a region is backed by a
+ *                range of an executable file. Its pages are read in on
+ *                first touch by vm_fault instead of at load time.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -118,6 +145,7 @@ struct addrspace {
  * functions are found in dumbvm.c.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
@@ -129,6 +157,9 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_backing(struct addrspace *as,
+                                    vaddr_t vaddr, size_t filesize,
+                                    struct vnode *v, off_t offset);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -144,7 +175,8 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
 struct region* region_mapping(struct addrspace* as, vaddr_t fault_addr);
-struct region* copy_region(struct addrspace* newas, struct region* old_region);
+struct region* copy_region(struct addrspace* old, struct addrspace* newas,
+                           const struct region* old_region);
 
 
 #endif /* _ADDRSPACE_H_ */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Disk blocks are cached in memory, looked up by (device, block),
+ * and written back lazily: a modified buffer goes to disk when it is
+ * evicted (least recently used first), when it has been dirty for a
+ * few seconds (by a background flusher thread), or when the
+ * filesystem syncs.
+ *
+ * A buffer handed out by buffer_read or buffer_get belongs to the
+ * caller alone until buffer_release; anyone else asking for the same
+ * block waits. Don't hold more than a handful at once.
+ *
+ * Functions:
+ *    buffer_bootstrap - set up the cache. Called from vfs_bootstrap.
+ *    buffer_start_threads - start the read-ahead and flusher threads.
+ *                       Called from boot once the clock is attached.
+ *    buffer_read      - get the buffer for BLOCK of DEV, reading it
+ *                       from disk if it isn't cached.
+ *    buffer_get       - get the buffer without reading it; its
+ *                       contents are undefined unless it was cached
+ *                       (see buffer_is_valid). For overwriting a
+ *                       whole block.
+ *    buffer_readahead - start reading blocks into the cache in the
+ *                       background, ahead of need.
+ *    buffer_is_valid  - whether the buffer holds the block's contents.
+ *    buffer_map       - the buffer's data (BUFFER_SIZE bytes).
+ *    buffer_mark_valid - the caller has filled in the whole buffer.
+ *    buffer_mark_dirty - the caller has modified the buffer, which
+ *                       must be valid; it will be written back.
+ *    buffer_release   - give the buffer back.
+ *    buffer_release_and_invalidate - give it back and forget its
+ *                       contents, e.g. after a failed overwrite.
+ *    buffer_throttle  - wait, if too many buffers are dirty, until
+ *                       enough have been written back. For writers,
+ *                       before they start dirtying more.
+ *    buffer_setdirtymax - set the limit buffer_throttle enforces.
+ *    buffer_sync      - write back all dirty buffers of DEV.
+ *    buffer_drop      - forget all (clean) buffers of DEV, for unmount.
+ *    buffer_printstats - print hit/miss and read-ahead counts.
+ */
+
+#define BUFFER_SIZE	512	/* bytes per block; one disk sector */
+
+struct device;
+struct buf;
+
+void buffer_bootstrap(void);
+void buffer_start_threads(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void buffer_readahead(struct device *dev, daddr_t block, unsigned count);
+bool buffer_is_valid(struct buf *b);
+void *buffer_map(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_release_and_invalidate(struct buf *b);
+
+void buffer_throttle(void);
+void buffer_setdirtymax(unsigned max);
+int buffer_sync(struct device *dev);
+void buffer_drop(struct device *dev);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
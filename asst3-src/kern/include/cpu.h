@@ -117,6 +117,13 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Read the current CPU's cycle counter. It wraps, and each CPU has
+ * its own, so only the difference of two nearby readings taken on
+ * the same CPU means anything.
+ */
+uint32_t cpu_getcycles(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
@@ -155,6 +162,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_allcpus is the same, sent to all CPUs except the
+ * current one; it returns how many CPUs that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +178,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
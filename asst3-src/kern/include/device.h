@@ -35,7 +35,7 @@
  */
 
 
-struct uio;  /* in <uio.h> */
+#include <uio.h> /* for uio_rw */
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +56,14 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_stats - print the device's statistics, or clear them if
+ *                    reset is true; NULL if it keeps none
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	void (*devop_stats)(struct device *, bool reset);
 };
 
 /*
@@ -69,8 +72,18 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_STATS(d, r)	((d)->d_ops->devop_stats(d, r))
 
 
+/*
+ * Vectored block I/O: transfer the kernel buffers IOV[0..IOVCNT-1],
+ * in order, to or from consecutive blocks of DEV starting at BLOCK,
+ * as a single request. The iovec lengths must add up to a multiple
+ * of the block size.
+ */
+int dev_iovio(struct device *dev, struct iovec *iov, unsigned iovcnt,
+	      daddr_t block, enum uio_rw rw);
+
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
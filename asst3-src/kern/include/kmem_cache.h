@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one fixed size, carved out of
+ * whole pages (slabs) without rounding up to a kmalloc size class.
+ *
+ * If the cache has a constructor, it is run the first time an object
+ * is handed out; when the object is freed it is kept constructed in
+ * the cache and handed out again as-is, so whatever the constructor
+ * set up (locks, wait channels, stacks) is reused. The destructor
+ * runs only when the cache actually gives the memory back. So an
+ * object must be freed in its constructed state, and its users must
+ * (re)initialize every other field after allocating it.
+ *
+ * Functions:
+ *    kmem_cache_create  - make a cache for objects of SIZE bytes.
+ *                         CTOR (which returns an error code) and DTOR
+ *                         may be NULL. NAME should be a string
+ *                         constant; it is printed by the stats.
+ *    kmem_cache_destroy - destroy a cache. All its objects must have
+ *                         been freed.
+ *    kmem_cache_alloc   - get an object; NULL if out of memory or the
+ *                         constructor failed.
+ *    kmem_cache_free    - give an object back to its cache.
+ *    kmem_cache_printstats - print the counters of every cache.
+ *
+ * None of these may be called while holding a spinlock.
+ */
+
+struct kmem_cache; /* Opaque */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_cache_printstats(void);
+
+
+#endif /* _KMEM_CACHE_H_ */
@@ -48,27 +48,87 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Loaded vnodes are found through a hash table on the inode number.
+ * Up to SFS_IDLEMAX vnodes that nobody is using any more are kept
+ * loaded (on the idle list, least recently used at the tail) in case
+ * they are wanted again soon.
+ */
+#define SFS_VNHASH_SIZE  128
+#define SFS_IDLEMAX      64
+
+/*
+ * Read-ahead window, in blocks: where it starts when a file is first
+ * read sequentially, and how far it can grow.
+ */
+#define SFS_RAMIN        4
+#define SFS_RAMAX        32
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i and sv_dirty (and, for a directory, its
+ * contents). It is held for reading by operations that only look, and
+ * for writing by ones that change anything. sv_ino and the inode type
+ * never change once the vnode is loaded and need no lock.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_dirhash *sv_dirhash; /* name index (directories only) */
+	daddr_t sv_lastblock;           /* last block allocated, or 0 */
+	struct rwlock *sv_lock;         /* protects the fields above */
+
+	/*
+	 * Last leaf indirect block sfs_bmap went through. sfs_bmap can
+	 * run with sv_lock held only for reading, so this has its own
+	 * spinlock.
+	 */
+	struct spinlock sv_bmaplock;
+	uint32_t sv_bmapbase;           /* first file block it maps */
+	daddr_t sv_bmapleaf;            /* its disk block, or 0 if none */
+
+	/* Sequential read detection for read-ahead; see sfs_io.c */
+	struct spinlock sv_ralock;
+	uint32_t sv_ranext;             /* where a sequential read would start */
+	uint32_t sv_rawindow;           /* window in blocks, 0 if not reading ahead */
+	uint32_t sv_raend;              /* first block not yet asked for */
+
+	/* These are protected by the fs's sfs_vnlock */
+	struct sfs_vnode *sv_hashnext;  /* next in hash chain */
+	struct sfs_vnode *sv_idlenext;  /* idle list links */
+	struct sfs_vnode *sv_idleprev;
+	bool sv_idle;                   /* true if on the idle list */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock ordering, outermost first:
+ *	sfs_renamelock
+ *	sv_lock of directories (parent before child; for two unrelated
+ *	    directories, lower inode number first)
+ *	sv_lock of files
+ *	sfs_vnlock
+ *	sfs_freemaplock
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* number loaded, including idle */
+	struct sfs_vnode *sfs_idlehead; /* idle vnodes, most recent first */
+	struct sfs_vnode *sfs_idletail;
+	unsigned sfs_nidle;             /* number of idle vnodes */
+	struct rwlock *sfs_vnlock;      /* protects all the vnode tables */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
+	struct lock *sfs_renamelock;    /* one rename at a time */
 };
 
 /*
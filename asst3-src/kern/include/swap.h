@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to a raw disk device, one page
+ * per swap slot. Slots are tracked with a bitmap. If the swap device
+ * is missing, swap_enabled is false and the VM system behaves as if
+ * there were no paging at all.
+ *
+ *    swap_bootstrap - open the swap device and set up the slot bitmap.
+ *                     Called from vm_bootstrap.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if full.
+ *
+ *    swap_free      - release a slot.
+ *
+ *    swap_in        - read the page in a slot into a physical frame.
+ *
+ *    swap_out       - write a physical frame to a slot.
+ *
+ *    swap_nslots    - total number of slots (0 if swap is disabled).
+ *
+ * swap_in and swap_out sleep; don't call them holding spinlocks.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+extern bool swap_enabled;
+
+/*
+ * Serializes page-out. A thread that finds a page in transit (HPT_BUSY)
+ * waits for it by acquiring and releasing this lock.
+ */
+extern struct lock *swap_lock;
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_out(paddr_t paddr, unsigned slot);
+unsigned swap_nslots(void);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
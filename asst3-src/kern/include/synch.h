@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -69,6 +70,17 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, since the holder will
+ * probably let go sooner than a context switch would take. It sleeps
+ * if the holder isn't running or the spin budget runs out.
+ *
+ * With "options lockstat", each lock counts its acquisitions, how
+ * many of them had to spin, how often a waiter slept, and how long
+ * (in cycles) it was held, and all locks are on a list so
+ * lock_printstats can show them. That list is global, so it is left
+ * out of ordinary kernels.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -78,6 +90,20 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+
+#if OPT_LOCKSTAT
+        /* statistics, protected by lk_lock */
+        unsigned lk_acquires;           /* times acquired */
+        unsigned lk_spins;              /* ... after spinning for it */
+        unsigned lk_sleeps;             /* times a waiter slept */
+        uint64_t lk_holdcycles;         /* total cycles held */
+        uint32_t lk_maxhold;            /* longest hold, in cycles */
+        uint32_t lk_acquiredat;         /* cycle count at acquire */
+        struct cpu *lk_acquiredon;      /* cpu that count is from */
+
+        struct lock *lk_next;           /* list of all locks */
+        struct lock *lk_prev;
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -91,12 +117,17 @@ void lock_destroy(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
+ *    lock_printstats - Print the statistics of contended locks, or of
+ *                   all locks if ALL is true. (lockstat kernels only)
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
+#if OPT_LOCKSTAT
+void lock_printstats(bool all);
+#endif
 
 
 /*
@@ -140,4 +171,54 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader/writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Neither kind of hold is recursive, and a reader may not upgrade to
+ * a writer.
+ *
+ * The lock prefers writers: once a writer is waiting, new readers
+ * wait behind it instead of joining the readers already inside, so a
+ * steady stream of readers can't starve writers out. Readers and
+ * writers sleep on separate wait channels so that each wakeup goes
+ * only to threads that can actually proceed.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers wait here */
+        struct spinlock rw_lock;
+        volatile unsigned rw_readers;   /* readers inside */
+        volatile unsigned rw_writerswaiting; /* writers queued */
+        struct thread *volatile rw_writer;
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Waits while a
+ *                           writer holds it or is waiting for it.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing. Waits until
+ *                           there are no readers or writer.
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding it may do this. A waiting writer,
+ *                           if any, goes next; otherwise all waiting
+ *                           readers are let in together.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -57,6 +57,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int rwtest2(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -90,12 +92,14 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int iobench(int, char **);
 
 /* other tests */
 int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmallocbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
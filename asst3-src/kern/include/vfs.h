@@ -164,6 +164,9 @@ int vfs_getcwd(struct uio *buf);
  *                    decref'd first. Similar to vfs_unmount.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_devstats  - Print the statistics of every device that keeps
+ *                    any, or clear them if RESET is true.
  */
 
 void vfs_bootstrap(void);
@@ -182,6 +185,7 @@ int vfs_unmount(const char *devname);
 int vfs_swapon(const char *devname, struct vnode **result);
 int vfs_swapoff(const char *devname);
 int vfs_unmountall(void);
+void vfs_devstats(bool reset);
 
 /*
  * Array of vnodes.
@@ -193,6 +197,26 @@ int vfs_unmountall(void);
 DECLARRAY(vnode, VFSINLINE);
 DEFARRAY(vnode, VFSINLINE);
 
+/*
+ * Name lookup cache (vfsdcache.c), used by vfs_lookup.
+ *
+ *    vfs_dcache_lookup     - Return the cached result of looking up a
+ *                            single name in a directory, with a new
+ *                            reference, or NULL.
+ *    vfs_dcache_generation - Get the value to pass to vfs_dcache_enter;
+ *                            call before doing the real lookup.
+ *    vfs_dcache_enter      - Cache the result of a successful lookup.
+ *    vfs_dcache_purge      - Forget a name that was removed or renamed.
+ *    vfs_dcache_purgefs    - Forget everything on a filesystem.
+ */
+void vfs_dcache_bootstrap(void);
+struct vnode *vfs_dcache_lookup(struct vnode *dir, const char *name);
+unsigned vfs_dcache_generation(void);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_dcache_purge(struct fs *fs, const char *name);
+void vfs_dcache_purgefs(struct fs *fs);
+
 /*
  * Global one-big-lock for all filesystem operations.
  */
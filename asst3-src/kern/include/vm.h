@@ -43,37 +43,71 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted */
 
+/*
+ * Hash pagetable entry. The table is one pre-allocated array probed by
+ * open addressing, so entries carry no chain pointer; a NULL PID marks
+ * an empty slot.
+ */
 struct hpt_entry {
 	struct addrspace * PID;				/* ASID */
 	vaddr_t VPN;						/* virtual page number */
 	paddr_t PFN;						/* PFN + valid bit + dirty bit */
-	struct hpt_entry * next_entry;		/* pointer to next entry for collision */
+	int as_next;						/* next slot of the same PID, or -1 */
+	int as_prev;						/* previous slot of the same PID, or -1 */
 };
 
+/*
+ * Software states kept in the low bits of hpt_entry.PFN, which the TLB
+ * ignores. A page that isn't TLBLO_VALID is either in swap, with the
+ * slot number where the frame number would be, or being paged out.
+ */
+#define HPT_SWAPPED          0x00000001    /* PFN >> 12 is a swap slot */
+#define HPT_BUSY             0x00000002    /* page-out in progress */
+
 struct frametable_entry {
         bool used;              /* indicate the frame is free or in used */
-        int next;               /* next free frame if the frame is not use */
+        int order;              /* log2 of block size, on a block's first frame */
+        int next;               /* next free block of the same order */
+        int prev;               /* previous free block of the same order */
+        unsigned refcount;      /* number of mappings sharing the frame */
+
+        /* user pages only: who maps the frame, for page replacement */
+        struct addrspace *as;   /* owning address space, NULL if none */
+        vaddr_t vpn;            /* virtual page it holds in that space */
+        int swapslot;           /* slot holding a clean copy, or -1 */
+        bool busy;              /* being evicted */
+        bool referenced;        /* loaded into the TLB since last sweep */
 };
 
 /* frametable */
 struct frametable_entry *frametable;
 
 /* hash pagetable */
-struct hpt_entry ** pagetable;
-
-/* hash pagetable lock to prevent concurrency issue */
-struct lock * hpt_lock;
+struct hpt_entry * pagetable;
 
-/* hash page table has twice as many entries as the frametable */
+/* hash page table has (at least) twice as many entries as the frametable */
 int hpt_size;
 
 void hpt_bootstrap(void);
-struct hpt_entry * hpt_lookup(struct addrspace * as, vaddr_t faultaddress);
-struct hpt_entry * hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit);
+bool hpt_lookup(struct addrspace * as, vaddr_t faultaddress, paddr_t *PFN);
+int hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit);
 void hpt_delete(struct addrspace * as, vaddr_t VPN);
+bool hpt_update(struct addrspace *as, vaddr_t VPN, paddr_t expected, paddr_t newpfn);
+int hpt_markbusy(struct addrspace *as, vaddr_t VPN, paddr_t paddr, paddr_t *oldpfn);
 uint32_t hpt_hash(struct addrspace *as, vaddr_t faultaddr);
-void write_tlb(vaddr_t VPN, paddr_t PFN);
+void write_tlb(struct addrspace *as, vaddr_t VPN, paddr_t PFN);
 void tlb_flush(void);
+void vm_activate(struct addrspace *as);
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t VPN);
+void vm_flushasid(struct addrspace *as);
+
+/* Page operations for fork and teardown that know about swap */
+int vm_sharepage(struct addrspace *as, vaddr_t vpn, paddr_t *paddr);
+void vm_destroypages(struct addrspace *as);
+
+/* Fault statistics, printed from the kernel menu */
+void vm_printstats(void);
+void vm_resetstats(void);
 
 /* Initialization function */
 void vm_bootstrap(void);
@@ -85,6 +119,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 void frametable_bootstrap(void);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
+void frametable_printstats(void);
+
+/* Share frames copy-on-write; free_kpages drops one reference */
+void frame_incref(paddr_t paddr);
+unsigned frame_getref(paddr_t paddr);
+
+/* Page replacement support */
+unsigned frametable_freecount(void);
+void frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vpn, int swapslot);
+void frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vpn);
+paddr_t frame_pickvictim(struct addrspace **as, vaddr_t *vpn, int *swapslot);
+void frame_unbusy(paddr_t paddr, bool evicted);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -42,11 +42,14 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
+#include <buf.h>
 #include <device.h>
 #include <pid.h>
+#include <openfile.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -109,11 +112,13 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -124,6 +129,8 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+	/* The buffer cache's flusher needs the clock; start it now. */
+	buffer_start_threads();
 	kheap_nextgeneration();
 
 	/* Late phase of initialization. */
@@ -41,12 +41,16 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
+#include <kmem_cache.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +504,118 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kcstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lock_printstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "all")) {
+		lock_printstats(true);
+	}
+	else {
+		kprintf("Usage: lockstat [all]\n");
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_ftstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	frametable_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_bufdirty(int nargs, char **args)
+{
+	int max;
+
+	if (nargs == 2) {
+		max = atoi(args[1]);
+		if (max <= 0) {
+			kprintf("bufdirty: maxbuffers must be positive\n");
+			return EINVAL;
+		}
+		buffer_setdirtymax(max);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: bufdirty [maxbuffers]\n");
+		return 0;
+	}
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vfs_devstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vfs_devstats(true);
+	}
+	else {
+		kprintf("Usage: diskstat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_resetstats();
+	}
+	else {
+		kprintf("Usage: vmstat [reset]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -566,6 +682,7 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[kmb] kmalloc throughput            ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -576,6 +693,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[rwt1] RW lock stress test          ",
+	"[rwt2] RW lock writer preference    ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -584,6 +703,7 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[iob] Disk read throughput          ",
 	NULL
 };
 
@@ -606,6 +726,15 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[kcstat] Object cache stats         ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
+	"[vmstat] VM fault stats             ",
+	"[ftstat] Physical memory stats      ",
+	"[bufstat] Buffer cache stats        ",
+	"[bufdirty] Set dirty buffer limit   ",
+	"[diskstat] Disk queue stats         ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +786,15 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "kcstat",     cmd_kcstats },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstats },
+#endif
+	{ "vmstat",     cmd_vmstats },
+	{ "ftstat",     cmd_ftstats },
+	{ "bufstat",    cmd_bufstats },
+	{ "bufdirty",   cmd_bufdirty },
+	{ "diskstat",   cmd_diskstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +805,7 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "kmb",	kmallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -679,6 +818,8 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "rwt1",	rwtest },
+	{ "rwt2",	rwtest2 },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -715,6 +856,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "iob",	iobench },
 
 	{ NULL, NULL }
 };
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
 #include <pid.h>
 
 /*
@@ -72,9 +73,36 @@ static struct lock *pidlock;		// lock for global exit data
 static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
+static struct kmem_cache *pidinfo_cache; // pidinfo allocation
 
 
 
+/*
+ * Object cache constructor and destructor for pidinfo. The cv is
+ * kept across reuses.
+ */
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_cv = cv_create("pidinfo cv");
+	if (pi->pi_cv == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+}
+
 /*
  * Create a pidinfo structure for the specified pid.
  */
@@ -86,17 +114,11 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
@@ -114,8 +136,7 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	kmem_cache_free(pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -133,6 +154,12 @@ pid_bootstrap(void)
 		panic("Out of memory creating pid lock\n");
 	}
 
+	pidinfo_cache = kmem_cache_create("pidinfo", sizeof(struct pidinfo),
+					  pidinfo_ctor, pidinfo_dtor);
+	if (pidinfo_cache == NULL) {
+		panic("Out of memory creating pidinfo cache\n");
+	}
+
 	/* not really necessary - should start zeroed */
 	for (i=0; i<PROCS_MAX; i++) {
 		pidinfo[i] = NULL;
@@ -39,7 +39,7 @@ bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
-	uint32_t x;
+	uint32_t x, goal, j;
 	int i;
 
 	(void)nargs;
@@ -101,6 +101,32 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Free a random subset again and get it back with alloc_near */
+	for (i=0; i<TESTSIZE; i++) {
+		data[i] = random()%2;
+		if (data[i]) {
+			bitmap_unmark(b, i);
+		}
+	}
+
+	goal = random() % TESTSIZE;
+	while (bitmap_alloc_near(b, goal, &x)==0) {
+		KASSERT(x < TESTSIZE);
+		KASSERT(bitmap_isset(b, x));
+		KASSERT(data[x]==1);
+		/* Should be the first free bit at or after the goal */
+		for (j=goal; j!=x; j=(j+1)%TESTSIZE) {
+			KASSERT(data[j]==0);
+		}
+		data[x] = 0;
+		goal = random() % TESTSIZE;
+	}
+
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+		KASSERT(data[i]==0);
+	}
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * iobench - raw disk read throughput.
+ *
+ * Reads the same stretch of a disk device several times, with
+ * requests of different sizes, and reports the throughput of each.
+ * The largest requests are vectored (one uio over several buffers),
+ * the way the buffer cache and the pager submit whole extents. Only
+ * reads; the disk contents are left alone.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define IOB_DEFAULTDEV  "lhd0raw:"
+#define IOB_SECTSIZE    512
+#define IOB_NSECT       1024    /* sectors read per pass (512k) */
+#define IOB_MAXREQ      64      /* sectors in the largest request */
+#define IOB_IOVSECT     8       /* sectors per iovec, for vectored requests */
+
+/*
+ * Read NSECT sectors from V, REQSECT sectors per request, each request
+ * split into iovecs of at most IOVSECT sectors. Prints the result.
+ */
+static
+int
+iobench_pass(struct vnode *v, char *buf, unsigned nsect,
+	     unsigned reqsect, unsigned iovsect)
+{
+	struct iovec iov[IOB_MAXREQ];
+	struct uio ku;
+	struct timespec before, after, duration;
+	uint64_t ns, kbps;
+	unsigned done, n, i, niov;
+	int result;
+
+	gettime(&before);
+
+	for (done = 0; done < nsect; done += n) {
+		n = reqsect;
+		if (n > nsect - done) {
+			n = nsect - done;
+		}
+
+		niov = 0;
+		for (i = 0; i < n; i += iovsect) {
+			iov[niov].iov_kbase = buf + i * IOB_SECTSIZE;
+			iov[niov].iov_len = ((n - i < iovsect) ? n - i : iovsect)
+				* IOB_SECTSIZE;
+			niov++;
+		}
+
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = niov;
+		ku.uio_offset = (off_t)done * IOB_SECTSIZE;
+		ku.uio_resid = n * IOB_SECTSIZE;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = UIO_READ;
+		ku.uio_space = NULL;
+
+		result = VOP_READ(v, &ku);
+		if (result) {
+			kprintf("iobench: read at sector %u: %s\n", done,
+				strerror(result));
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("iobench: short read at sector %u\n", done);
+			return EIO;
+		}
+	}
+
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	ns = duration.tv_sec * (uint64_t)1000000000 + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kbps = (uint64_t)nsect * IOB_SECTSIZE * 1000000000 / ns / 1024;
+
+	kprintf("iobench: %2u sectors/request, %u iovec(s): "
+		"%llu.%03lu s, %llu KB/s\n",
+		reqsect, DIVROUNDUP(reqsect, iovsect),
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)(duration.tv_nsec / 1000000),
+		(unsigned long long)kbps);
+	return 0;
+}
+
+int
+iobench(int nargs, char **args)
+{
+	char devname[32];
+	struct vnode *v;
+	struct stat st;
+	unsigned nsect;
+	char *buf;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: iob [device]\n");
+		return EINVAL;
+	}
+	strcpy(devname, IOB_DEFAULTDEV);
+	if (nargs == 2) {
+		if (strlen(args[1]) >= sizeof(devname)) {
+			return ENAMETOOLONG;
+		}
+		strcpy(devname, args[1]);
+	}
+
+	buf = kmalloc(IOB_MAXREQ * IOB_SECTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	/* vfs_open may modify the name */
+	result = vfs_open(devname, O_RDONLY, 0, &v);
+	if (result) {
+		kprintf("iobench: %s: %s\n", args[nargs-1], strerror(result));
+		kfree(buf);
+		return result;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		goto out;
+	}
+	nsect = st.st_size / IOB_SECTSIZE;
+	if (nsect > IOB_NSECT) {
+		nsect = IOB_NSECT;
+	}
+	if (nsect == 0) {
+		kprintf("iobench: device is empty\n");
+		result = EINVAL;
+		goto out;
+	}
+
+	kprintf("iobench: reading %u sectors\n", nsect);
+
+	/* one sector at a time: what the filesystem used to do */
+	result = iobench_pass(v, buf, nsect, 1, 1);
+	if (result) {
+		goto out;
+	}
+	/* a page at a time: what the pager does */
+	result = iobench_pass(v, buf, nsect, IOB_IOVSECT, IOB_IOVSECT);
+	if (result) {
+		goto out;
+	}
+	/* whole extents, scattered over several buffers */
+	result = iobench_pass(v, buf, nsect, IOB_MAXREQ, IOB_IOVSECT);
+
+ out:
+	vfs_close(v);
+	kfree(buf);
+	return result;
+}
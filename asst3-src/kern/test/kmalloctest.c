@@ -33,6 +33,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
@@ -378,3 +379,121 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// kmb
+
+/*
+ * kmalloc throughput benchmark. Each thread repeatedly allocates a
+ * handful of small blocks of mixed sizes and then frees them, which
+ * is the pattern lock_create, kstrdup and friends produce. All the
+ * threads start together; we report the combined number of
+ * kmalloc/kfree pairs per second.
+ *
+ * The argument is the number of threads (default NTHREADS).
+ */
+
+#define KMB_ROUNDS 2000
+#define KMB_BATCH  8
+#define KMB_MAXTHREADS 64
+
+struct kmbench {
+	struct semaphore *kb_go;
+	struct semaphore *kb_done;
+};
+
+static
+void
+kmallocbenchthread(void *kbv, unsigned long num)
+{
+	static const size_t sizes[KMB_BATCH] =
+		{ 16, 24, 40, 64, 100, 200, 500, 1000 };
+
+	struct kmbench *kb = kbv;
+	void *ptrs[KMB_BATCH];
+	unsigned i, j;
+
+	P(kb->kb_go);
+
+	for (i=0; i<KMB_ROUNDS; i++) {
+		for (j=0; j<KMB_BATCH; j++) {
+			ptrs[j] = kmalloc(sizes[(i + j) % KMB_BATCH]);
+			if (ptrs[j] == NULL) {
+				panic("kmallocbench: thread %lu: "
+				      "kmalloc failed\n", num);
+			}
+		}
+		for (j=0; j<KMB_BATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+
+	V(kb->kb_done);
+}
+
+int
+kmallocbench(int nargs, char **args)
+{
+	struct kmbench kb;
+	struct timespec before, after, duration;
+	uint64_t ns, total, rate;
+	unsigned nthreads, i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: kmb [nthreads]\n");
+		return EINVAL;
+	}
+	nthreads = NTHREADS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads == 0 || nthreads > KMB_MAXTHREADS) {
+		kprintf("kmallocbench: thread count must be 1-%u\n",
+			KMB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	kb.kb_go = sem_create("kmb_go", 0);
+	kb.kb_done = sem_create("kmb_done", 0);
+	if (kb.kb_go == NULL || kb.kb_done == NULL) {
+		panic("kmallocbench: sem_create failed\n");
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmallocbench", NULL,
+				     kmallocbenchthread, &kb, i);
+		if (result) {
+			panic("kmallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		V(kb.kb_go);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(kb.kb_done);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	sem_destroy(kb.kb_go);
+	sem_destroy(kb.kb_done);
+
+	ns = duration.tv_sec * (uint64_t)1000000000 + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	total = (uint64_t)nthreads * KMB_ROUNDS * KMB_BATCH;
+	rate = total * 1000000000 / ns;
+
+	kprintf("kmallocbench: %u threads, %llu allocs: "
+		"%llu.%03lu s, %llu allocs/s\n",
+		nthreads, (unsigned long long)total,
+		(unsigned long long)duration.tv_sec,
+		(unsigned long)(duration.tv_nsec / 1000000),
+		(unsigned long long)rate);
+	return 0;
+}
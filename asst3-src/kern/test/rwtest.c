@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Reader/writer lock tests.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NRWTHREADS    32
+#define NRWLOOPS      200
+#define RWWRITEEVERY  8		/* one pass in this many writes */
+
+static struct rwlock *testrw;
+static struct semaphore *rwdonesem;
+
+/* What the threads saw; protected by rwstatlock. */
+static struct spinlock rwstatlock = SPINLOCK_INITIALIZER;
+static unsigned readersin, writersin, maxreaders;
+static unsigned nreads, nwrites, nfailures;
+static unsigned seq, writerseq, readerseq;
+
+/* Protected by testrw itself. */
+static volatile unsigned long rwval1;
+static volatile unsigned long rwval2;
+
+static
+void
+rw_inititems(void)
+{
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	if (rwdonesem == NULL) {
+		rwdonesem = sem_create("rwdonesem", 0);
+		if (rwdonesem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+
+	spinlock_acquire(&rwstatlock);
+	readersin = writersin = maxreaders = 0;
+	nreads = nwrites = nfailures = 0;
+	seq = writerseq = readerseq = 0;
+	spinlock_release(&rwstatlock);
+}
+
+static
+void
+rw_fail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwstatlock);
+	nfailures++;
+	spinlock_release(&rwstatlock);
+}
+
+static
+void
+rw_reader(unsigned long num)
+{
+	unsigned long v1, v2;
+	volatile int j;
+	bool bad;
+
+	rwlock_acquire_read(testrw);
+
+	spinlock_acquire(&rwstatlock);
+	readersin++;
+	if (readersin > maxreaders) {
+		maxreaders = readersin;
+	}
+	bad = writersin > 0;
+	nreads++;
+	spinlock_release(&rwstatlock);
+	if (bad) {
+		rw_fail(num, "Reader inside with a writer");
+	}
+
+	/* Give other readers a chance to come in alongside us. */
+	v1 = rwval1;
+	for (j=0; j<200; j++);
+	thread_yield();
+	v2 = rwval2;
+	if (v2 != v1*v1) {
+		rw_fail(num, "Reader saw a half-done write");
+	}
+
+	spinlock_acquire(&rwstatlock);
+	readersin--;
+	spinlock_release(&rwstatlock);
+
+	rwlock_release_read(testrw);
+}
+
+static
+void
+rw_writer(unsigned long num)
+{
+	bool bad;
+
+	rwlock_acquire_write(testrw);
+
+	spinlock_acquire(&rwstatlock);
+	writersin++;
+	bad = writersin != 1 || readersin > 0;
+	nwrites++;
+	spinlock_release(&rwstatlock);
+	if (bad) {
+		rw_fail(num, "Writer not alone");
+	}
+
+	/* Write in two steps, so an overlapping reader would notice. */
+	rwval1 = num;
+	thread_yield();
+	rwval2 = num*num;
+	if (rwval1 != num || rwval2 != num*num) {
+		rw_fail(num, "Writer's values changed under it");
+	}
+
+	spinlock_acquire(&rwstatlock);
+	writersin--;
+	spinlock_release(&rwstatlock);
+
+	rwlock_release_write(testrw);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (i % RWWRITEEVERY == num % RWWRITEEVERY) {
+			rw_writer(num);
+		}
+		else {
+			rw_reader(num);
+		}
+	}
+	V(rwdonesem);
+}
+
+/*
+ * Stress test: lots of threads mixing reads and writes, checking that
+ * writers are always alone and readers never see a write in progress.
+ */
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	rw_inititems();
+	rwval1 = rwval2 = 0;
+	kprintf("Starting rwlock stress test...\n");
+
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	kprintf("%u reads, %u writes, up to %u readers at once\n",
+		nreads, nwrites, maxreaders);
+	if (nfailures > 0) {
+		kprintf("Test failed (%u errors)\n", nfailures);
+	}
+	else {
+		kprintf("rwlock stress test done.\n");
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Check that the lock prefers writers: with a reader inside and a
+ * writer queued, a newly arriving reader has to wait for the writer.
+ */
+
+static
+void
+prefwriter(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_write(testrw);
+	spinlock_acquire(&rwstatlock);
+	writerseq = ++seq;
+	spinlock_release(&rwstatlock);
+	rwlock_release_write(testrw);
+	V(rwdonesem);
+}
+
+static
+void
+prefreader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrw);
+	spinlock_acquire(&rwstatlock);
+	readerseq = ++seq;
+	spinlock_release(&rwstatlock);
+	rwlock_release_read(testrw);
+	V(rwdonesem);
+}
+
+int
+rwtest2(int nargs, char **args)
+{
+	bool early;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	rw_inititems();
+	kprintf("Starting rwlock writer preference test...\n");
+
+	rwlock_acquire_read(testrw);
+
+	result = thread_fork("rwtest2", NULL, prefwriter, NULL, 0);
+	if (result) {
+		panic("rwtest2: thread_fork failed: %s\n", strerror(result));
+	}
+
+	/* Wait for the writer to queue up behind us. */
+	while (testrw->rw_writerswaiting == 0) {
+		thread_yield();
+	}
+
+	result = thread_fork("rwtest2", NULL, prefreader, NULL, 0);
+	if (result) {
+		panic("rwtest2: thread_fork failed: %s\n", strerror(result));
+	}
+
+	/* Give the reader plenty of time to get in if it's going to. */
+	clocksleep(1);
+	spinlock_acquire(&rwstatlock);
+	early = readerseq != 0;
+	spinlock_release(&rwstatlock);
+
+	rwlock_release_read(testrw);
+	P(rwdonesem);
+	P(rwdonesem);
+
+	if (early || readerseq < writerseq) {
+		kprintf("Reader got in ahead of a waiting writer\n");
+		kprintf("Test failed\n");
+	}
+	else {
+		kprintf("rwlock writer preference test done.\n");
+	}
+
+	return 0;
+}
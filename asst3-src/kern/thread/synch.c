@@ -35,6 +35,7 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
@@ -138,6 +139,21 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Spin budget for lock_acquire: how many times to poll a lock whose
+ * holder is running on another cpu before going to sleep. The holder
+ * is rechecked under lk_lock every LOCK_SPINCHECK polls, in case it
+ * has blocked meanwhile.
+ */
+#define LOCK_SPINMAX	2000
+#define LOCK_SPINCHECK	50
+
+#if OPT_LOCKSTAT
+/* List of all locks, for lock_printstats. */
+static struct spinlock lock_listlock = SPINLOCK_INITIALIZER;
+static struct lock *lock_list;
+#endif
+
 struct lock *
 lock_create(const char *name)
 {
@@ -165,6 +181,25 @@ lock_create(const char *name)
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
 
+#if OPT_LOCKSTAT
+	lock->lk_acquires = 0;
+	lock->lk_spins = 0;
+	lock->lk_sleeps = 0;
+	lock->lk_holdcycles = 0;
+	lock->lk_maxhold = 0;
+	lock->lk_acquiredat = 0;
+	lock->lk_acquiredon = NULL;
+
+	spinlock_acquire(&lock_listlock);
+	lock->lk_prev = NULL;
+	lock->lk_next = lock_list;
+	if (lock_list != NULL) {
+		lock_list->lk_prev = lock;
+	}
+	lock_list = lock;
+	spinlock_release(&lock_listlock);
+#endif
+
 	return lock;
 }
 
@@ -174,6 +209,22 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+
+#if OPT_LOCKSTAT
+	spinlock_acquire(&lock_listlock);
+	if (lock->lk_prev != NULL) {
+		lock->lk_prev->lk_next = lock->lk_next;
+	}
+	else {
+		KASSERT(lock_list == lock);
+		lock_list = lock->lk_next;
+	}
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prev = lock->lk_prev;
+	}
+	spinlock_release(&lock_listlock);
+#endif
+
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +232,27 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Check if the holder of a lock is running on another cpu, in which
+ * case it's worth spinning for the lock. This only reads the
+ * holder's state as a hint; the caller holds lk_lock, so the holder
+ * can't let go of the lock and go away meanwhile.
+ */
+static
+bool
+lock_holder_running(struct lock *lock, struct thread *holder)
+{
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	return holder->t_state == S_RUN && holder->t_cpu != curcpu;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned polls, i;
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,12 +262,40 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+	polls = 0;
+	while ((holder = lock->lk_holder) != NULL) {
+		if (polls < LOCK_SPINMAX &&
+		    lock_holder_running(lock, holder)) {
+			/*
+			 * Poll without lk_lock (so the holder can get
+			 * it to release) until the holder changes or
+			 * it's time to recheck whether it's running.
+			 */
+			spinlock_release(&lock->lk_lock);
+			for (i=0; i<LOCK_SPINCHECK &&
+				     lock->lk_holder == holder; i++) {
+				polls++;
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		/* As in the semaphore. */
+#if OPT_LOCKSTAT
+		lock->lk_sleeps++;
+#endif
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
 
+#if OPT_LOCKSTAT
+	lock->lk_acquires++;
+	if (polls > 0) {
+		lock->lk_spins++;
+	}
+	lock->lk_acquiredon = curcpu;
+	lock->lk_acquiredat = cpu_getcycles();
+#endif
+
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
@@ -213,6 +310,20 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
+
+#if OPT_LOCKSTAT
+	/* Hold times are only meaningful if we didn't change cpus. */
+	if (lock->lk_acquiredon == curcpu) {
+		uint32_t held;
+
+		held = cpu_getcycles() - lock->lk_acquiredat;
+		lock->lk_holdcycles += held;
+		if (held > lock->lk_maxhold) {
+			lock->lk_maxhold = held;
+		}
+	}
+#endif
+
 	lock->lk_holder = NULL;
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
@@ -236,6 +347,36 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+#if OPT_LOCKSTAT
+void
+lock_printstats(bool all)
+{
+	struct lock *lock;
+	uint64_t avghold;
+
+	spinlock_acquire(&lock_listlock);
+	kprintf("%-20s %9s %7s %7s %10s %10s\n", "lock", "acquires",
+		"spins", "sleeps", "avg hold", "max hold");
+	for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+		spinlock_acquire(&lock->lk_lock);
+		if (all || lock->lk_spins > 0 || lock->lk_sleeps > 0) {
+			avghold = 0;
+			if (lock->lk_acquires > 0) {
+				avghold = lock->lk_holdcycles /
+					lock->lk_acquires;
+			}
+			kprintf("%-20s %9u %7u %7u %10llu %10u\n",
+				lock->lk_name, lock->lk_acquires,
+				lock->lk_spins, lock->lk_sleeps,
+				(unsigned long long)avghold,
+				lock->lk_maxhold);
+		}
+		spinlock_release(&lock->lk_lock);
+	}
+	spinlock_release(&lock_listlock);
+}
+#endif /* OPT_LOCKSTAT */
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -315,3 +456,152 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader/writer lock.
+//
+// Writers are preferred: a reader only gets in when no writer holds
+// the lock and none is queued for it. In the common uncontended case
+// a reader just bumps rw_readers under the spinlock and never touches
+// a wait channel, and the last reader out only issues a wakeup if a
+// writer is actually waiting.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_wwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(rw->rw_writer == NULL);
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		/* readers behind the writer keep waiting */
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	if (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		/* being counted here is what holds new readers off */
+		rw->rw_writerswaiting++;
+		do {
+			wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+		} while (rw->rw_writer != NULL || rw->rw_readers > 0);
+		rw->rw_writerswaiting--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	else {
+		/* no writers left; the readers can all go in together */
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
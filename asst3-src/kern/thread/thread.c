@@ -42,6 +42,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <kmem_cache.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -69,6 +70,10 @@ DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
 static struct cpuarray allcpus;
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -111,6 +116,32 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor and destructor for threads. A thread
+ * coming back out of the cache keeps the stack it had before, so
+ * thread_fork doesn't need to allocate one.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,14 +154,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,7 +170,7 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_stack is kept from the cache (see thread_ctor) */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -211,9 +242,12 @@ cpu_create(unsigned hardware_number)
 		 * make it possible to free the boot stack?)
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		if (c->c_curthread->t_stack == NULL) {
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		}
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -277,9 +311,7 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	/* the stack stays with the thread in the cache (see thread_ctor) */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -287,7 +319,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -376,6 +408,12 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -508,8 +546,10 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless the thread came with one */
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+	}
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -529,7 +569,7 @@ thread_fork(const char *name,
 	}
 	result = proc_addthread(proc, newthread);
 	if (result) {
-		/* thread_destroy will clean up the stack */
+		/* thread_destroy will take care of the stack */
 		thread_destroy(newthread);
 		return result;
 	}
@@ -962,6 +1002,45 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Object cache constructor and destructor for wait channels. A wait
+ * channel goes back into the cache empty, so its thread list can be
+ * reused as it is.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. This has to happen before anything
+ * creates a lock, so it is called very early, ahead of
+ * thread_bootstrap.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -975,11 +1054,10 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
@@ -992,8 +1070,8 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1167,6 +1245,26 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs except the current one.
+ * Returns the number of CPUs it was sent to.
+ */
+unsigned
+ipi_tlbshootdown_allcpus(const struct tlbshootdown *mapping)
+{
+	unsigned i, sent = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			sent++;
+		}
+	}
+	return sent;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -0,0 +1,988 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Buffer cache.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <device.h>
+#include <vfs.h>
+#include <buf.h>
+
+/*
+ * Number of buffers the cache may grow to (256 * 512 = 128k), and
+ * number of hash chains.
+ */
+#define BUFFER_MAX	256
+#define BUFFER_HASHSIZE	64
+
+/* Most consecutive dirty blocks buffer_sync writes in one request */
+#define BUFFER_CLUSTER	16
+
+/* Number of pending read-ahead requests; more than that are dropped */
+#define BUFFER_RAQUEUE	32
+
+/*
+ * Write-back policy. The flusher thread wakes every BUFFER_FLUSHSECS
+ * and writes back buffers that have been dirty for BUFFER_DIRTYSECS
+ * or more; every BUFFER_SYNCSECS it also syncs all the filesystems,
+ * so inodes and free maps kept in the filesystems' own structures get
+ * out too. Writers are made to wait (see buffer_throttle) while more
+ * than BUFFER_DIRTYMAX buffers are dirty; this can be changed at run
+ * time with buffer_setdirtymax.
+ */
+#define BUFFER_FLUSHSECS	1
+#define BUFFER_DIRTYSECS	5
+#define BUFFER_SYNCSECS		30
+#define BUFFER_DIRTYMAX		(BUFFER_MAX / 2)
+
+struct buf {
+	struct device *b_dev;		/* device, NULL if unused */
+	daddr_t b_block;		/* block number on the device */
+	bool b_valid;			/* data holds the block */
+	bool b_dirty;			/* data must be written back */
+	bool b_busy;			/* handed out, or doing I/O */
+	bool b_readahead;		/* read ahead and not used yet */
+	time_t b_dirtysecs;		/* when it became dirty */
+	void *b_data;			/* BUFFER_SIZE bytes */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lrunext;		/* toward least recently used */
+	struct buf *b_lruprev;		/* toward most recently used */
+};
+
+/*
+ * All of the following is protected by buffer_lock. Threads waiting
+ * for a buffer to stop being busy wait on buffer_cv.
+ */
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* most recently used */
+static struct buf *buffer_lrutail;	/* least recently used */
+static unsigned buffer_num;
+static unsigned buffer_ndirty;
+static unsigned buffer_dirtymax = BUFFER_DIRTYMAX;
+
+static unsigned buffer_hits;		/* lookups found in the cache */
+static unsigned buffer_misses;		/* lookups that weren't */
+static unsigned buffer_reads;		/* blocks read from disk */
+static unsigned buffer_writes;		/* blocks written to disk */
+static unsigned buffer_evictions;	/* buffers reused for another block */
+static unsigned buffer_clusters;	/* multi-block writes by buffer_sync */
+static unsigned buffer_flushed;		/* blocks written by the flusher */
+static unsigned buffer_throttled;	/* writes made to wait for the flush */
+
+/*
+ * Read-ahead requests waiting for the read-ahead thread, which sleeps
+ * on buffer_racv. buffer_radev is the device it's reading from right
+ * now, if any.
+ */
+struct buffer_rareq {
+	struct device *r_dev;
+	daddr_t r_block;
+	unsigned r_count;
+};
+static struct buffer_rareq buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_ranum;
+static struct cv *buffer_racv;
+static struct device *buffer_radev;
+
+static unsigned buffer_rablocks;	/* blocks read ahead */
+static unsigned buffer_rahits;		/* ...that were then used */
+static unsigned buffer_rawasted;	/* ...that were evicted unused */
+static unsigned buffer_radropped;	/* requests dropped, queue full */
+
+static void buffer_readahead_thread(void *, unsigned long);
+static void buffer_flush_thread(void *, unsigned long);
+
+/*
+ * Setup function
+ */
+void
+buffer_bootstrap(void)
+{
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_racv = cv_create("buffer read-ahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+}
+
+/*
+ * Start the read-ahead and flusher threads. This is separate from
+ * buffer_bootstrap because the flusher reads the clock, which isn't
+ * attached until mainbus_bootstrap has run.
+ */
+void
+buffer_start_threads(void)
+{
+	if (thread_fork("readahead", NULL, buffer_readahead_thread,
+			NULL, 0)) {
+		panic("buffer_start_threads: Could not start "
+		      "read-ahead thread\n");
+	}
+	if (thread_fork("bufflush", NULL, buffer_flush_thread, NULL, 0)) {
+		panic("buffer_start_threads: Could not start flusher thread\n");
+	}
+}
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(struct device) + block)
+		% BUFFER_HASHSIZE;
+}
+
+static
+void
+buffer_unhash(struct buf *b)
+{
+	struct buf **pp;
+
+	pp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_valid = false;
+	if (b->b_readahead) {
+		buffer_rawasted++;
+		b->b_readahead = false;
+	}
+}
+
+static
+void
+buffer_rehash(struct buf *b, struct device *dev, daddr_t block)
+{
+	unsigned h;
+
+	if (b->b_dev != NULL) {
+		buffer_unhash(b);
+	}
+	h = buffer_hashfunc(dev, block);
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+/*
+ * Move B to the most recently used end of the LRU list.
+ */
+static
+void
+buffer_touch(struct buf *b)
+{
+	if (b == buffer_lruhead) {
+		return;
+	}
+
+	/* unlink */
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	if (b == buffer_lrutail) {
+		buffer_lrutail = b->b_lruprev;
+	}
+
+	/* put at the head */
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	buffer_lruhead = b;
+	if (buffer_lrutail == NULL) {
+		buffer_lrutail = b;
+	}
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	b = buffer_hash[buffer_hashfunc(dev, block)];
+	while (b != NULL) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+		b = b->b_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Current time in seconds, for aging dirty buffers.
+ */
+static
+time_t
+buffer_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Read or write a buffer, retrying I/O errors. The buffer is busy;
+ * the cache lock is not held.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries=0;
+
+	KASSERT(b->b_busy);
+	KASSERT(!lock_do_i_hold(buffer_lock));
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  ((off_t)b->b_block) * BUFFER_SIZE, rw);
+	result = DEVOP_IO(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: DEVOP_IO returned EINVAL on block %u\n",
+		      b->b_block);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up "
+				"after %d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write back a dirty buffer that isn't busy. Called with the cache
+ * lock held; drops it during the I/O.
+ */
+static
+int
+buffer_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_busy);
+
+	b->b_busy = true;
+	lock_release(buffer_lock);
+
+	result = buffer_io(b, UIO_WRITE);
+
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		b->b_dirty = false;
+		buffer_ndirty--;
+		buffer_writes++;
+	}
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+/*
+ * Is there a buffer for BLOCK of DEV that could be written back along
+ * with a neighbour? Returns it, or NULL.
+ */
+static
+struct buf *
+buffer_clusterable(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	b = buffer_find(dev, block);
+	if (b == NULL || b->b_busy || !b->b_dirty) {
+		return NULL;
+	}
+	return b;
+}
+
+/*
+ * Write back dirty buffer B together with the dirty buffers for the
+ * blocks on either side of it, as one vectored request. Called with
+ * the cache lock held; drops it during the I/O.
+ */
+static
+int
+buffer_writecluster(struct buf *b)
+{
+	struct buf *run[BUFFER_CLUSTER];
+	struct iovec iov[BUFFER_CLUSTER];
+	struct device *dev = b->b_dev;
+	daddr_t start = b->b_block;
+	unsigned i, n;
+	int result;
+
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_busy);
+
+	/* find the start of the run, then collect it going forward */
+	while (start > 0 && b->b_block - start < BUFFER_CLUSTER - 1 &&
+	       buffer_clusterable(dev, start - 1) != NULL) {
+		start--;
+	}
+	for (n = 0; n < BUFFER_CLUSTER; n++) {
+		run[n] = buffer_clusterable(dev, start + n);
+		if (run[n] == NULL) {
+			break;
+		}
+		run[n]->b_busy = true;
+		iov[n].iov_kbase = run[n]->b_data;
+		iov[n].iov_len = BUFFER_SIZE;
+	}
+	KASSERT(n > 0);
+
+	lock_release(buffer_lock);
+	result = dev_iovio(dev, iov, n, start, UIO_WRITE);
+	lock_acquire(buffer_lock);
+
+	for (i = 0; i < n; i++) {
+		if (result == 0) {
+			run[i]->b_dirty = false;
+		}
+		run[i]->b_busy = false;
+	}
+	if (result == 0) {
+		KASSERT(buffer_ndirty >= n);
+		buffer_ndirty -= n;
+		buffer_writes += n;
+		if (n > 1) {
+			buffer_clusters++;
+		}
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+/*
+ * Find a buffer to hold a new block: a fresh one if the cache can
+ * still grow, otherwise the least recently used one not in use.
+ * Returns NULL, having dropped the lock and waited or written
+ * something back, if the caller should look the block up again.
+ */
+static
+struct buf *
+buffer_getfree(void)
+{
+	struct buf *b;
+
+	if (buffer_num < BUFFER_MAX) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUFFER_SIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			b->b_dev = NULL;
+			b->b_block = 0;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_busy = false;
+			b->b_readahead = false;
+			b->b_hashnext = NULL;
+			b->b_lrunext = b->b_lruprev = NULL;
+			buffer_touch(b);
+			buffer_num++;
+			return b;
+		}
+		/* out of memory; recycle one instead */
+	}
+
+	for (b = buffer_lrutail; b != NULL; b = b->b_lruprev) {
+		if (b->b_busy) {
+			continue;
+		}
+		if (b->b_dirty) {
+			/* may sleep; someone may cache our block meanwhile */
+			buffer_writeback(b);
+			return NULL;
+		}
+		if (b->b_dev != NULL) {
+			buffer_evictions++;
+		}
+		return b;
+	}
+
+	/* everything is in use */
+	cv_wait(buffer_cv, buffer_lock);
+	return NULL;
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buffer_acquire(struct device *dev, daddr_t block, bool doread,
+	       struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			buffer_hits++;
+			if (b->b_readahead) {
+				buffer_rahits++;
+				b->b_readahead = false;
+			}
+			break;
+		}
+
+		b = buffer_getfree();
+		if (b != NULL) {
+			buffer_misses++;
+			buffer_rehash(b, dev, block);
+			break;
+		}
+	}
+
+	b->b_busy = true;
+	buffer_touch(b);
+
+	if (!doread || b->b_valid) {
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	/* read it in; others wanting the block wait because it's busy */
+	lock_release(buffer_lock);
+	result = buffer_io(b, UIO_READ);
+	lock_acquire(buffer_lock);
+	if (result) {
+		buffer_unhash(b);
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+		lock_release(buffer_lock);
+		return result;
+	}
+	b->b_valid = true;
+	buffer_reads++;
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Read up to BUFFER_CLUSTER blocks of DEV starting at START into the
+ * cache as one request, stopping at the first block that's already
+ * cached. Returns the number of blocks covered (read or found), so
+ * the caller can go on from there. Called with the cache lock held;
+ * drops it during the I/O.
+ */
+static
+unsigned
+buffer_readrun(struct device *dev, daddr_t start, unsigned count)
+{
+	struct buf *run[BUFFER_CLUSTER];
+	struct iovec iov[BUFFER_CLUSTER];
+	struct buf *b;
+	unsigned i, n;
+	int result;
+
+	if (count > BUFFER_CLUSTER) {
+		count = BUFFER_CLUSTER;
+	}
+
+	n = 0;
+	while (n < count) {
+		if (buffer_find(dev, start + n) != NULL) {
+			break;
+		}
+		b = buffer_getfree();
+		if (b == NULL) {
+			if (n > 0) {
+				/* don't sit on busy buffers while waiting */
+				break;
+			}
+			/* slept; the block may have been cached meanwhile */
+			continue;
+		}
+		buffer_rehash(b, dev, start + n);
+		b->b_busy = true;
+		run[n] = b;
+		iov[n].iov_kbase = b->b_data;
+		iov[n].iov_len = BUFFER_SIZE;
+		n++;
+	}
+	if (n == 0) {
+		/* the first one was already there */
+		return 1;
+	}
+
+	lock_release(buffer_lock);
+	result = dev_iovio(dev, iov, n, start, UIO_READ);
+	lock_acquire(buffer_lock);
+
+	for (i = 0; i < n; i++) {
+		if (result == 0) {
+			run[i]->b_valid = true;
+			run[i]->b_readahead = true;
+			buffer_touch(run[i]);
+		}
+		else {
+			buffer_unhash(run[i]);
+		}
+		run[i]->b_busy = false;
+	}
+	if (result == 0) {
+		buffer_reads += n;
+		buffer_rablocks += n;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return n;
+}
+
+/*
+ * The read-ahead thread: take requests off the queue and read them
+ * in, in runs of up to BUFFER_CLUSTER blocks.
+ */
+static
+void
+buffer_readahead_thread(void *data1, unsigned long data2)
+{
+	struct buffer_rareq r;
+	unsigned done;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_ranum == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		r = buffer_raqueue[buffer_rahead];
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_ranum--;
+
+		buffer_radev = r.r_dev;
+		while (r.r_count > 0) {
+			done = buffer_readrun(r.r_dev, r.r_block, r.r_count);
+			r.r_block += done;
+			r.r_count -= done;
+		}
+		buffer_radev = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+/*
+ * Ask for COUNT blocks of DEV starting at BLOCK to be read into the
+ * cache in the background. This is only a hint: it never waits for
+ * the disk, and if too many requests are already pending it's
+ * dropped.
+ */
+void
+buffer_readahead(struct device *dev, daddr_t block, unsigned count)
+{
+	unsigned slot;
+
+	if (count == 0) {
+		return;
+	}
+
+	lock_acquire(buffer_lock);
+	if (buffer_ranum == BUFFER_RAQUEUE) {
+		buffer_radropped++;
+	}
+	else {
+		slot = (buffer_rahead + buffer_ranum) % BUFFER_RAQUEUE;
+		buffer_raqueue[slot].r_dev = dev;
+		buffer_raqueue[slot].r_block = block;
+		buffer_raqueue[slot].r_count = count;
+		buffer_ranum++;
+		cv_signal(buffer_racv, buffer_lock);
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_acquire(dev, block, true, ret);
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_acquire(dev, block, false, ret);
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	if (b->b_dirty) {
+		return;
+	}
+
+	lock_acquire(buffer_lock);
+	b->b_dirty = true;
+	b->b_dirtysecs = buffer_now();
+	buffer_ndirty++;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	if (!b->b_valid) {
+		/* never filled in; don't leave it findable */
+		KASSERT(!b->b_dirty);
+		buffer_unhash(b);
+	}
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	if (b->b_dirty) {
+		b->b_dirty = false;
+		buffer_ndirty--;
+	}
+	buffer_unhash(b);
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Find the least recently used dirty buffer that isn't busy and was
+ * dirtied at or before CUTOFF.
+ */
+static
+struct buf *
+buffer_olddirty(time_t cutoff)
+{
+	struct buf *b;
+
+	for (b = buffer_lrutail; b != NULL; b = b->b_lruprev) {
+		if (b->b_dirty && !b->b_busy && b->b_dirtysecs <= cutoff) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The flusher thread: write back buffers that have been dirty for a
+ * while, so a crash loses at most a few seconds of writes, and
+ * periodically sync the filesystems.
+ */
+static
+void
+buffer_flush_thread(void *data1, unsigned long data2)
+{
+	struct buf *b;
+	time_t lastsync, now;
+	unsigned n;
+
+	(void)data1;
+	(void)data2;
+
+	lastsync = buffer_now();
+	while (1) {
+		clocksleep(BUFFER_FLUSHSECS);
+		now = buffer_now();
+
+		if (now - lastsync >= BUFFER_SYNCSECS) {
+			vfs_sync();
+			lastsync = now;
+		}
+
+		lock_acquire(buffer_lock);
+		while ((b = buffer_olddirty(now - BUFFER_DIRTYSECS)) != NULL) {
+			n = buffer_writes;
+			if (buffer_writecluster(b)) {
+				/* it stays dirty; try again next time */
+				break;
+			}
+			buffer_flushed += buffer_writes - n;
+		}
+		lock_release(buffer_lock);
+	}
+}
+
+/*
+ * Hold up a writer while too many buffers are dirty, writing back the
+ * oldest ones (and their neighbours) until the count is within the
+ * limit again. Called before a filesystem starts a write, holding no
+ * buffers.
+ */
+void
+buffer_throttle(void)
+{
+	struct buf *b;
+	bool waited = false;
+
+	lock_acquire(buffer_lock);
+	while (buffer_ndirty > buffer_dirtymax) {
+		waited = true;
+		b = buffer_olddirty(buffer_now());
+		if (b == NULL) {
+			/* all the dirty ones are in use */
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		if (buffer_writecluster(b)) {
+			/* I/O error; don't spin on it */
+			break;
+		}
+	}
+	if (waited) {
+		buffer_throttled++;
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Set the dirty buffer limit. Zero means the default.
+ */
+void
+buffer_setdirtymax(unsigned max)
+{
+	lock_acquire(buffer_lock);
+	buffer_dirtymax = max > 0 ? max : BUFFER_DIRTYMAX;
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back every dirty buffer of DEV, in runs of consecutive blocks
+ * where possible. Buffers in use are waited for.
+ *
+ * Each write drops the lock, and buffers used meanwhile move to the
+ * front of the LRU list, so a single walk can miss some. Rather than
+ * starting over after every write, carry on from where we were
+ * (buffers never leave the list) and make further passes until one
+ * finds nothing left to write.
+ */
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b, *next;
+	bool wrote;
+	int result;
+
+	lock_acquire(buffer_lock);
+	do {
+		wrote = false;
+		for (b = buffer_lruhead; b != NULL; b = next) {
+			if (b->b_dev != dev || !b->b_dirty) {
+				next = b->b_lrunext;
+				continue;
+			}
+			if (b->b_busy) {
+				/* look at it again once it's released */
+				cv_wait(buffer_cv, buffer_lock);
+				next = b;
+				continue;
+			}
+			result = buffer_writecluster(b);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+			wrote = true;
+			next = b->b_lrunext;
+		}
+	} while (wrote);
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Forget every buffer of DEV. They must all be clean and not in use;
+ * sync first. Read-ahead for DEV that hasn't happened yet is
+ * cancelled, and any in progress is waited for.
+ */
+void
+buffer_drop(struct device *dev)
+{
+	struct buf *b;
+	unsigned i, n, from, to;
+
+	lock_acquire(buffer_lock);
+
+	n = buffer_ranum;
+	to = 0;
+	for (i = 0; i < n; i++) {
+		from = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raqueue[from].r_dev != dev) {
+			buffer_raqueue[(buffer_rahead + to) % BUFFER_RAQUEUE] =
+				buffer_raqueue[from];
+			to++;
+		}
+	}
+	buffer_ranum = to;
+	while (buffer_radev == dev) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev == dev) {
+			KASSERT(!b->b_busy);
+			KASSERT(!b->b_dirty);
+			buffer_unhash(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Print the cache statistics, for sizing it against a workload.
+ */
+void
+buffer_printstats(void)
+{
+	unsigned hits, misses, reads, writes, evictions, clusters;
+	unsigned rablocks, rahits, rawasted, radropped;
+	unsigned flushed, throttled;
+	unsigned num, ndirty, dirtymax;
+
+	lock_acquire(buffer_lock);
+	hits = buffer_hits;
+	misses = buffer_misses;
+	reads = buffer_reads;
+	writes = buffer_writes;
+	evictions = buffer_evictions;
+	clusters = buffer_clusters;
+	rablocks = buffer_rablocks;
+	rahits = buffer_rahits;
+	rawasted = buffer_rawasted;
+	radropped = buffer_radropped;
+	flushed = buffer_flushed;
+	throttled = buffer_throttled;
+	num = buffer_num;
+	ndirty = buffer_ndirty;
+	dirtymax = buffer_dirtymax;
+	lock_release(buffer_lock);
+
+	kprintf("buffer cache: %u/%u buffers (%u dirty, limit %u)\n",
+		num, BUFFER_MAX, ndirty, dirtymax);
+	kprintf("buffer cache: %u hits, %u misses", hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+	}
+	kprintf("\n");
+	kprintf("buffer cache: %u blocks read, %u written "
+		"(%u multi-block writes), %u evictions\n",
+		reads, writes, clusters, evictions);
+	kprintf("buffer cache: %u blocks read ahead, %u used, "
+		"%u evicted unused, %u requests dropped\n",
+		rablocks, rahits, rawasted, radropped);
+	kprintf("buffer cache: %u blocks written by the flusher, "
+		"%u writes throttled\n", flushed, throttled);
+}
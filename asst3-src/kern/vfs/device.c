@@ -350,6 +350,38 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_lookparent = vopfail_lookparent_notdir,
 };
 
+/*
+ * Vectored block I/O on a device, bypassing the vnode layer: one
+ * DEVOP_IO call for the whole extent, however many buffers it is
+ * scattered over. Used by the buffer cache to write back runs of
+ * consecutive blocks.
+ */
+int
+dev_iovio(struct device *d, struct iovec *iov, unsigned iovcnt,
+	  daddr_t block, enum uio_rw rw)
+{
+	struct uio ku;
+	size_t len = 0;
+	unsigned i;
+
+	for (i=0; i<iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	if (len % d->d_blocksize != 0) {
+		return EINVAL;
+	}
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = iovcnt;
+	ku.uio_offset = (off_t)block * d->d_blocksize;
+	ku.uio_resid = len;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	return DEVOP_IO(d, &ku);
+}
+
 /*
  * Function to create a vnode for a VFS device.
  */
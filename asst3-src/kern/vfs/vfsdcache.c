@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name lookup cache.
+ *
+ * Remembers the results of recent single-component lookups, keyed
+ * by (directory vnode, name), so vfs_lookup can skip VOP_LOOKUP for
+ * names it has seen recently. Each entry holds a reference to both
+ * vnodes. Only successful lookups are cached, so creating a name
+ * never makes the cache wrong; removing or renaming one does, and
+ * the VFS layer calls vfs_dcache_purge when that happens.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vnode.h>
+#include <vfs.h>
+
+/* Number of entries the cache may hold, and number of hash chains. */
+#define DCACHE_MAX	256
+#define DCACHE_HASHSIZE	64
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory looked in */
+	char *dc_name;			/* name looked up */
+	struct vnode *dc_vn;		/* what it found */
+	unsigned dc_hash;		/* which chain it's on */
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lrunext;	/* toward least recently used */
+	struct dcentry *dc_lruprev;	/* toward most recently used */
+};
+
+/*
+ * Each hash chain has its own spinlock, so lookups of different
+ * names don't contend. dcache_lrulock protects the LRU list (the
+ * dc_lru fields), dcache_num, and dcache_gen; it is only ever taken
+ * briefly, and inside a chain lock if both are needed. An entry is
+ * only removed with both its chain lock and dcache_lrulock held.
+ *
+ * dcache_gen counts purges. A lookup that started before a purge
+ * may have found the name that was just removed, so vfs_dcache_enter
+ * refuses entries from lookups that began in an older generation.
+ */
+static struct spinlock dcache_chainlocks[DCACHE_HASHSIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+
+static struct spinlock dcache_lrulock = SPINLOCK_INITIALIZER;
+static struct dcentry *dcache_lruhead;	/* most recently used */
+static struct dcentry *dcache_lrutail;	/* least recently used */
+static unsigned dcache_num;
+static unsigned dcache_gen;
+
+/*
+ * Setup function
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		spinlock_init(&dcache_chainlocks[i]);
+	}
+}
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	uint32_t h;
+
+	/* FNV-1a over the name, seeded with the directory */
+	h = 2166136261U ^ (uint32_t)((uintptr_t)dir / sizeof(struct vnode));
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lrunext = dc->dc_lruprev = NULL;
+}
+
+static
+void
+dcache_lru_insert(struct dcentry *dc)
+{
+	dc->dc_lruprev = NULL;
+	dc->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = dc;
+	}
+	else {
+		dcache_lrutail = dc;
+	}
+	dcache_lruhead = dc;
+}
+
+/*
+ * Take the entry *PP off its hash chain and out of the LRU list.
+ * The caller holds the chain lock and dcache_lrulock. The entry is
+ * put on the list *DEAD (linked through dc_hashnext) to be freed by
+ * dcache_free once the locks are released, because dropping the
+ * vnode references may reclaim them.
+ */
+static
+void
+dcache_remove(struct dcentry **pp, struct dcentry **dead)
+{
+	struct dcentry *dc = *pp;
+
+	KASSERT(spinlock_do_i_hold(&dcache_chainlocks[dc->dc_hash]));
+	KASSERT(spinlock_do_i_hold(&dcache_lrulock));
+
+	*pp = dc->dc_hashnext;
+	dcache_lru_remove(dc);
+	KASSERT(dcache_num > 0);
+	dcache_num--;
+
+	dc->dc_hashnext = *dead;
+	*dead = dc;
+}
+
+static
+void
+dcache_free(struct dcentry *dead)
+{
+	struct dcentry *dc;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	while (dead != NULL) {
+		dc = dead;
+		dead = dc->dc_hashnext;
+		VOP_DECREF(dc->dc_vn);
+		VOP_DECREF(dc->dc_dir);
+		kfree(dc->dc_name);
+		kfree(dc);
+	}
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name, unsigned h)
+{
+	struct dcentry *dc;
+
+	KASSERT(spinlock_do_i_hold(&dcache_chainlocks[h]));
+
+	for (dc = dcache_hash[h]; dc != NULL; dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Evict least recently used entries until the cache is back under
+ * DCACHE_MAX. The victim's chain lock has to be taken before
+ * dcache_lrulock, so we note the victim, drop dcache_lrulock, and
+ * then look for it on its chain; if someone else removed it
+ * meanwhile, we just go around again.
+ */
+static
+void
+dcache_trim(void)
+{
+	struct dcentry *victim, **pp, *dead = NULL;
+	unsigned h;
+
+	while (1) {
+		spinlock_acquire(&dcache_lrulock);
+		if (dcache_num <= DCACHE_MAX) {
+			spinlock_release(&dcache_lrulock);
+			break;
+		}
+		victim = dcache_lrutail;
+		h = victim->dc_hash;
+		spinlock_release(&dcache_lrulock);
+
+		spinlock_acquire(&dcache_chainlocks[h]);
+		for (pp = &dcache_hash[h]; *pp != NULL;
+		     pp = &(*pp)->dc_hashnext) {
+			if (*pp == victim) {
+				spinlock_acquire(&dcache_lrulock);
+				dcache_remove(pp, &dead);
+				spinlock_release(&dcache_lrulock);
+				break;
+			}
+		}
+		spinlock_release(&dcache_chainlocks[h]);
+	}
+
+	dcache_free(dead);
+}
+
+/*
+ * Look up NAME in DIR. Returns the vnode, with a new reference, or
+ * NULL if it isn't cached.
+ */
+struct vnode *
+vfs_dcache_lookup(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+	struct vnode *ret = NULL;
+	unsigned h;
+
+	h = dcache_hashfunc(dir, name);
+
+	spinlock_acquire(&dcache_chainlocks[h]);
+	dc = dcache_find(dir, name, h);
+	if (dc != NULL) {
+		ret = dc->dc_vn;
+		VOP_INCREF(ret);
+
+		spinlock_acquire(&dcache_lrulock);
+		if (dcache_lruhead != dc) {
+			dcache_lru_remove(dc);
+			dcache_lru_insert(dc);
+		}
+		spinlock_release(&dcache_lrulock);
+	}
+	spinlock_release(&dcache_chainlocks[h]);
+
+	return ret;
+}
+
+/*
+ * Get the current generation, to pass to vfs_dcache_enter after the
+ * lookup.
+ */
+unsigned
+vfs_dcache_generation(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&dcache_lrulock);
+	ret = dcache_gen;
+	spinlock_release(&dcache_lrulock);
+
+	return ret;
+}
+
+/*
+ * Remember that looking up NAME in DIR found VN. GEN is what
+ * vfs_dcache_generation returned before the lookup began. If we
+ * can't allocate memory we just don't cache it.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *dc;
+	unsigned h;
+	bool stale;
+
+	dc = kmalloc(sizeof(*dc));
+	if (dc == NULL) {
+		return;
+	}
+	dc->dc_name = kstrdup(name);
+	if (dc->dc_name == NULL) {
+		kfree(dc);
+		return;
+	}
+	h = dcache_hashfunc(dir, name);
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	dc->dc_hash = h;
+
+	spinlock_acquire(&dcache_chainlocks[h]);
+	if (dcache_find(dir, name, h) != NULL) {
+		spinlock_release(&dcache_chainlocks[h]);
+		kfree(dc->dc_name);
+		kfree(dc);
+		return;
+	}
+
+	/*
+	 * Check the generation and go on the LRU list in one step, so
+	 * a purge either sees a new generation here or finds the
+	 * entry when it then scans this chain.
+	 */
+	spinlock_acquire(&dcache_lrulock);
+	stale = gen != dcache_gen;
+	if (!stale) {
+		VOP_INCREF(dir);
+		VOP_INCREF(vn);
+		dc->dc_hashnext = dcache_hash[h];
+		dcache_hash[h] = dc;
+		dcache_lru_insert(dc);
+		dcache_num++;
+	}
+	spinlock_release(&dcache_lrulock);
+	spinlock_release(&dcache_chainlocks[h]);
+
+	if (stale) {
+		kfree(dc->dc_name);
+		kfree(dc);
+		return;
+	}
+
+	dcache_trim();
+}
+
+/*
+ * Forget every entry for a directory on FS, and named NAME if NAME
+ * isn't NULL. Bumps the generation first, so lookups already under
+ * way can't put back what we remove.
+ */
+static
+void
+dcache_purge(struct fs *fs, const char *name)
+{
+	struct dcentry **pp, *dead = NULL;
+	unsigned h;
+
+	spinlock_acquire(&dcache_lrulock);
+	dcache_gen++;
+	spinlock_release(&dcache_lrulock);
+
+	for (h=0; h<DCACHE_HASHSIZE; h++) {
+		spinlock_acquire(&dcache_chainlocks[h]);
+		pp = &dcache_hash[h];
+		while (*pp != NULL) {
+			if ((*pp)->dc_dir->vn_fs == fs &&
+			    (name == NULL || !strcmp((*pp)->dc_name, name))) {
+				spinlock_acquire(&dcache_lrulock);
+				dcache_remove(pp, &dead);
+				spinlock_release(&dcache_lrulock);
+			}
+			else {
+				pp = &(*pp)->dc_hashnext;
+			}
+		}
+		spinlock_release(&dcache_chainlocks[h]);
+	}
+
+	dcache_free(dead);
+}
+
+/*
+ * NAME in some directory of FS has been removed or renamed. Forget
+ * it in every directory of FS, so we don't need to know which
+ * directory vnode the caller's path went through.
+ */
+void
+vfs_dcache_purge(struct fs *fs, const char *name)
+{
+	dcache_purge(fs, name);
+}
+
+/*
+ * Forget everything on FS, so it can be unmounted.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	dcache_purge(fs, NULL);
+}
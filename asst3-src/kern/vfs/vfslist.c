@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -90,6 +91,14 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for the device list. Every name lookup that starts with a
+ * device or volume name reads the list, while it only changes when
+ * devices are added or filesystems mounted and unmounted, so let the
+ * readers share it.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -106,12 +115,20 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+	vfs_dcache_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -174,8 +191,13 @@ vfs_sync(void)
 {
 	struct knowndev *dev;
 	unsigned i, num;
+	bool locked;
 
-	vfs_biglock_acquire();
+	/* We can get here from panic in the middle of a mount or unmount. */
+	locked = !rwlock_do_i_hold_write(knowndevs_lock);
+	if (locked) {
+		rwlock_acquire_read(knowndevs_lock);
+	}
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -185,11 +207,36 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	if (locked) {
+		rwlock_release_read(knowndevs_lock);
+	}
 
 	return 0;
 }
 
+/*
+ * Print (or reset) the statistics of all devices that keep any.
+ */
+void
+vfs_devstats(bool reset)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	rwlock_acquire_read(knowndevs_lock);
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_device != NULL &&
+		    dev->kd_device->d_ops->devop_stats != NULL) {
+			DEVOP_STATS(dev->kd_device, reset);
+		}
+	}
+
+	rwlock_release_read(knowndevs_lock);
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -199,8 +246,15 @@ vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
+
+	/*
+	 * If we get through the loop, the device specified by devname
+	 * doesn't exist.
+	 */
+	result = ENODEV;
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -221,13 +275,15 @@ vfs_getroot(const char *devname, struct vnode **ret)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				return FSOP_GETROOT(kd->kd_fs, ret);
+				result = FSOP_GETROOT(kd->kd_fs, ret);
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -242,7 +298,8 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
-			return 0;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -253,7 +310,8 @@ vfs_getroot(const char *devname, struct vnode **ret)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*ret = kd->kd_vnode;
-			return 0;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -263,11 +321,8 @@ vfs_getroot(const char *devname, struct vnode **ret)
 		 */
 	}
 
-	/*
-	 * If we got here, the device specified by devname doesn't exist.
-	 */
-
-	return ENODEV;
+	rwlock_release_read(knowndevs_lock);
+	return result;
 }
 
 /*
@@ -278,10 +333,11 @@ vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	const char *name = NULL;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -294,11 +350,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	rwlock_release_read(knowndevs_lock);
+	return name;
 }
 
 /*
@@ -358,7 +416,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,7 +459,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -453,7 +511,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 
  fail:
@@ -470,7 +528,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -509,7 +567,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +601,16 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -560,7 +618,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
@@ -573,7 +631,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 }
 
@@ -601,7 +659,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -622,7 +680,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 	*ret = kd->kd_vnode;
 
  out:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,7 +698,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -654,6 +712,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop the name cache's references into the fs */
+	vfs_dcache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -673,7 +734,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -690,7 +751,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -710,7 +771,7 @@ vfs_swapoff(const char *devname)
 	KASSERT(result==0);
 
  fail:
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 }
 
@@ -724,7 +785,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -745,6 +806,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_dcache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -780,7 +843,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 
 	return 0;
 }
@@ -35,12 +35,14 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +53,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -133,8 +137,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Entirely empty filenames aren't legal.
 	 */
@@ -195,11 +197,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -246,11 +251,13 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
+	/*
+	 * Finding the starting vnode takes no big lock: the device
+	 * list and bootfs have their own locks, and once we have a
+	 * reference to the vnode the filesystem does its own locking.
+	 */
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -268,33 +275,107 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Check if PATH can be looked up a name at a time: every name in it
+ * is nonempty (no leading, trailing, or doubled slashes) and not too
+ * long.
+ */
+static
+bool
+lookup_walkable(const char *path)
+{
+	const char *end;
+	size_t len;
+
+	while (1) {
+		end = strchr(path, '/');
+		len = end != NULL ? (size_t)(end - path) : strlen(path);
+		if (len == 0 || len > NAME_MAX) {
+			return false;
+		}
+		if (end == NULL) {
+			return true;
+		}
+		path = end + 1;
+	}
+}
+
 int
 vfs_lookup(char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *dir, *vn;
+	char name[NAME_MAX+1];
+	char *end;
+	size_t len;
+	bool cacheable;
+	unsigned gen = 0;
 	int result;
 
-	vfs_biglock_acquire();
-
-	result = getdevice(path, &path, &startvn);
+	/* As in vfs_lookparent. */
+	result = getdevice(path, &path, &dir);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
-		*retval = startvn;
-		vfs_biglock_release();
+		*retval = dir;
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	if (dir->vn_fs == NULL || !lookup_walkable(path)) {
+		/*
+		 * A device, or a path with empty or overlong names;
+		 * let the filesystem make of it what it always did.
+		 */
+		result = VOP_LOOKUP(dir, path, retval);
+		VOP_DECREF(dir);
+		return result;
+	}
 
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
-	return result;
+	/*
+	 * Walk the path one name at a time, so that each step can be
+	 * answered from the name cache. (Leave . and .. to the
+	 * filesystem; what they refer to can change without either
+	 * name being removed.)
+	 */
+	while (1) {
+		end = strchr(path, '/');
+		len = end != NULL ? (size_t)(end - path) : strlen(path);
+
+		memcpy(name, path, len);
+		name[len] = '\0';
+		cacheable = strcmp(name, ".") && strcmp(name, "..");
+
+		vn = cacheable ? vfs_dcache_lookup(dir, name) : NULL;
+		if (vn == NULL) {
+			if (cacheable) {
+				gen = vfs_dcache_generation();
+			}
+			result = VOP_LOOKUP(dir, name, &vn);
+			if (result) {
+				VOP_DECREF(dir);
+				return result;
+			}
+			if (cacheable) {
+				/* VOP_LOOKUP may have scribbled on it */
+				memcpy(name, path, len);
+				name[len] = '\0';
+				vfs_dcache_enter(dir, name, vn, gen);
+			}
+		}
+
+		VOP_DECREF(dir);
+		dir = vn;
+
+		if (end == NULL) {
+			break;
+		}
+		path = end + 1;
+	}
+
+	*retval = dir;
+	return 0;
 }
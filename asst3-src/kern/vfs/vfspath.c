@@ -146,6 +146,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_dcache_purge(dir->vn_fs, name);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +182,10 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		vfs_dcache_purge(olddir->vn_fs, oldname);
+		vfs_dcache_purge(newdir->vn_fs, newname);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -308,6 +315,9 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		vfs_dcache_purge(parent->vn_fs, name);
+	}
 
 	VOP_DECREF(parent);
 
@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -37,6 +39,8 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
+#include <kmem_cache.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -48,6 +52,48 @@
  *
  */
 
+/* object caches for address spaces and regions */
+static struct kmem_cache *as_cache;
+static struct kmem_cache *region_cache;
+
+/*
+ * as_ctor()/as_dtor() - an address space goes back into the cache with
+ * an empty region array, which keeps its storage for the next user
+ */
+static
+int
+as_ctor(void *obj)
+{
+    struct addrspace *as = obj;
+
+    regionarray_init(&as->regions);
+    return 0;
+}
+
+static
+void
+as_dtor(void *obj)
+{
+    struct addrspace *as = obj;
+
+    regionarray_cleanup(&as->regions);
+}
+
+/*
+ * as_bootstrap() - set up the caches, called from vm_bootstrap
+ */
+void
+as_bootstrap(void)
+{
+    as_cache = kmem_cache_create("addrspace", sizeof(struct addrspace),
+                                 as_ctor, as_dtor);
+    region_cache = kmem_cache_create("region", sizeof(struct region),
+                                     NULL, NULL);
+    if(as_cache == NULL || region_cache == NULL) {
+        panic("as_bootstrap: out of memory\n");
+    }
+}
+
 /*
  * as_create() - create an address space
  */
@@ -56,19 +102,43 @@ as_create(void)
 {
     struct addrspace *as;
 
-    as = kmalloc(sizeof(struct addrspace));
+    as = kmem_cache_alloc(as_cache);
     if (as == NULL) {
         return NULL;
     }
 
     /*
-     * Initialize as needed.
+     * Initialize as needed. The region array is already empty.
      */
-    as->regions = NULL;
+    KASSERT(regionarray_num(&as->regions) == 0);
+    as->as_lasthit = NULL;
+    as->as_pages = -1;
+    bzero(as->as_asid, sizeof(as->as_asid));
 
     return as;
 }
 
+/*
+ * region_search() - index of the first region whose vbase is above
+ * VADDR, i.e. where a region starting at VADDR would be inserted
+ */
+static
+unsigned
+region_search(struct addrspace *as, vaddr_t vaddr)
+{
+    unsigned lo = 0, hi = regionarray_num(&as->regions);
+
+    while(lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if(regionarray_get(&as->regions, mid)->vbase <= vaddr) {
+            lo = mid + 1;
+        }else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /*
  * as_copy() - create a new address space that is an exact copy of an old one
  */
@@ -85,54 +155,73 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     /*
      * Write this.
      */
-    /* deep copy, need to copy physical frame and hpt entry as well */
-    newas->regions = copy_region(newas, old->regions);
+    /*
+     * copy-on-write: the new address space shares every resident
+     * frame of the old one read-only; the first write to a page on
+     * either side makes its own copy (see vm_fault)
+     */
+    unsigned num = regionarray_num(&old->regions);
+    if(regionarray_preallocate(&newas->regions, num)) {
+        as_destroy(newas);
+        return ENOMEM;
+    }
+
+    /* already in order, so they can just be appended */
+    for(unsigned i = 0; i < num; i++) {
+        struct region *reg = copy_region(old, newas,
+                                         regionarray_get(&old->regions, i));
+        if(reg == NULL) {
+            as_destroy(newas);
+            return ENOMEM;
+        }
+        /* can't fail; the space is preallocated */
+        regionarray_add(&newas->regions, reg, NULL);
+    }
+
+    /* drop write permission from any TLB entries the old one has */
+    vm_flushasid(old);
 
     *ret = newas;
     return 0;
 }
 
+/*
+ * region_destroy() - free a region and its reference to the backing
+ * file. Its pages belong to the address space and are freed with it.
+ */
+static
+void
+region_destroy(struct region *reg)
+{
+    if(reg->vn != NULL) {
+        VOP_DECREF(reg->vn);
+    }
+    kmem_cache_free(region_cache, reg);
+}
+
 /*
  * as_destory() - free one address space along with its regions, frame and hpt
  */
 void
 as_destroy(struct addrspace *as)
 {
-    /* clean up all the regions, its physical frame and hpt entry */
-    while (as->regions != NULL) {
-        struct region *temp = as->regions;
-        as->regions = as->regions->next;
-        for(uint32_t i = 0; i < temp->npages; i++) {
-            vaddr_t faultaddress = temp->vbase + i*PAGE_SIZE;
-            struct hpt_entry * temp_entry = hpt_lookup(as, faultaddress);
-
-            if(temp_entry != NULL) {
-                paddr_t PFN = temp_entry->PFN;
-
-                /* reset cache/dirty/valid bits */
-                PFN &= ~TLBLO_NOCACHE;
-                PFN &= ~TLBLO_DIRTY;
-                PFN &= ~TLBLO_VALID;
-
-                /* free physical frame */
-                kfree((void *)PADDR_TO_KVADDR(PFN));
-
-                /* delete corresponding entry in pagetable */
-                hpt_delete(temp_entry->PID, temp_entry->VPN);
-            }
-        }
+    /* drop every page it has, in one batch */
+    vm_destroypages(as);
 
-        kfree(temp);
+    /* then the regions */
+    unsigned num = regionarray_num(&as->regions);
+    for(unsigned i = 0; i < num; i++) {
+        region_destroy(regionarray_get(&as->regions, i));
     }
+    regionarray_setsize(&as->regions, 0);
 
-    /* free data structure itself */
-    kfree(as);
+    /* free data structure itself; the array goes with it (see as_ctor) */
+    kmem_cache_free(as_cache, as);
 }
 
 void
 as_activate(void)
 {
-    /*flush TLB*/
     struct addrspace *as;
 
     as = proc_getas();
@@ -145,9 +234,10 @@ as_activate(void)
     }
 
     /*
-     * Write this.
+     * No TLB flush needed: entries are tagged with the ASID, so we
+     * only have to switch the current ASID to this address space's.
      */
-    tlb_flush();
+    vm_activate(as);
 }
 
 void
@@ -159,22 +249,10 @@ as_deactivate(void)
      * be needed.
      */
 
-    //flush tlb
-    struct addrspace *as;
-
-    as = proc_getas();
-    if (as == NULL) {
-        /*
-         * Kernel thread without an address space; leave the
-         * prior address space in place.
-         */
-        return;
-    }
-
     /*
-     * Write this.
+     * Nothing to do: the outgoing address space's TLB entries are
+     * tagged with its ASID and can't match anyone else's accesses.
      */
-    tlb_flush();
 }
 
 /*
@@ -191,7 +269,8 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
          int readable, int writeable, int executable)
 {
-    struct region *cur, *prev;
+    unsigned num, pos;
+    int result;
 
     if(as == NULL) {
         return EINVAL;
@@ -209,71 +288,83 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
     npages = memsize / PAGE_SIZE;
 
     /* initialize region attributes */
-    struct region* reg = (struct region *) kmalloc(sizeof(struct region));
+    struct region* reg = kmem_cache_alloc(region_cache);
+    if(reg == NULL) {
+        return ENOMEM;
+    }
     reg->vbase = vaddr;
     reg->npages = npages;
     reg->read = readable;
     reg->write = writeable;
     reg->execute = executable;
-    reg->old_write = writeable;
-    reg->next = NULL;
-
-    if(as->regions == NULL) {
-        as->regions = reg;
-    }else {
-        cur = prev = as->regions;
-        while(cur != NULL && cur->vbase < reg->vbase) {
-            prev = cur; 
-            cur = cur->next;
-        }
-        prev->next = reg;
-        reg->next = cur;
+    reg->vn = NULL;
+    reg->filebase = 0;
+    reg->fileoff = 0;
+    reg->filesz = 0;
+
+    /* keep the array sorted: slide later regions up one slot */
+    num = regionarray_num(&as->regions);
+    pos = region_search(as, vaddr);
+    result = regionarray_setsize(&as->regions, num + 1);
+    if(result) {
+        kmem_cache_free(region_cache, reg);
+        return result;
+    }
+    for(unsigned i = num; i > pos; i--) {
+        regionarray_set(&as->regions, i, regionarray_get(&as->regions, i - 1));
     }
+    regionarray_set(&as->regions, pos, reg);
 
     /* define a new region successfully. */
     return 0;
 }
     
+/*
+ * as_define_backing() - back the region containing VADDR with FILESIZE
+ * bytes of V starting at OFFSET, placed at VADDR. The region holds a
+ * reference to V until it is destroyed.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_backing(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+                  struct vnode *v, off_t offset)
 {
-    /*
-     * Write this.
-     */
-    // as_activate();
-    // make use of prepare_load_recover_flag to recover the
-    // access stuff later
-    struct region * cur = as->regions;
-    while(cur != NULL) {
-        if(cur->write == 0) {
-            // write set to 1
-            cur->old_write = cur->write;
-            cur->write = 1;
-        } 
-
-        cur = cur->next;
+    struct region *reg;
+
+    reg = region_mapping(as, vaddr);
+    if(reg == NULL || reg->vn != NULL) {
+        return EINVAL;
     }
-    
+
+    /* the file data must lie inside the region */
+    if(filesize > reg->vbase + reg->npages * PAGE_SIZE - vaddr) {
+        return EINVAL;
+    }
+
+    VOP_INCREF(v);
+    reg->vn = v;
+    reg->filebase = vaddr;
+    reg->fileoff = offset;
+    reg->filesz = filesize;
     return 0;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_prepare_load(struct addrspace *as)
 {
     /*
-     * Write this.
+     * Nothing to do: segments are no longer copied in at load time.
+     * vm_fault reads each page from the executable on first touch,
+     * through the kernel mapping of the frame, so read-only regions
+     * don't have to be made writable while loading.
      */
-    // as_activate();
-
-    struct region * cur = as->regions;
-    while(cur != NULL) {
-        if(cur->old_write == 0) {
-            /* restore original write bit */
-            cur->write = 0;
-        } 
+    (void)as;
+    return 0;
+}
 
-        cur = cur->next;
-    }
+int
+as_complete_load(struct addrspace *as)
+{
+    (void)as;
     return 0;
 }
 
@@ -296,84 +387,89 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 /* 
- * copy_region() - Deep copy the regions along with the linked-list
+ * copy_region() - Copy one region into NEWAS. The resident pages are
+ * shared copy-on-write: each frame gains a reference and is mapped
+ * without the dirty bit on both sides. Returns NULL if out of memory,
+ * having undone its own work.
  */
 struct region * 
-copy_region(struct addrspace * newas, struct region* old_region) {
-    if(old_region == NULL) {
+copy_region(struct addrspace *old, struct addrspace * newas, const struct region* old_region) {
+    /* allocate memory for new region */
+    struct region * new_region = kmem_cache_alloc(region_cache);
+    if(new_region == NULL) {
         return NULL;
     }
 
-    /* allocate memory for new region */
-    struct region * new_region = (struct region *)kmalloc(sizeof(struct region));
-
     /* initialise the new region */
     new_region->vbase = old_region->vbase;
     new_region->npages = old_region->npages;
     new_region->read = old_region->read;
     new_region->write = old_region->write;
     new_region->execute = old_region->execute;
-    new_region->old_write = old_region->old_write;
+    new_region->vn = old_region->vn;
+    new_region->filebase = old_region->filebase;
+    new_region->fileoff = old_region->fileoff;
+    new_region->filesz = old_region->filesz;
+    if(new_region->vn != NULL) {
+        VOP_INCREF(new_region->vn);
+    }
 
-    /* copy the corresponding physical frame and insert newly created frame to pagetable. */
+    /* share the corresponding physical frame through the pagetable. */
     for(uint32_t i = 0; i<old_region->npages; i++) {
         vaddr_t faultaddress = old_region->vbase + i*PAGE_SIZE;
-        struct hpt_entry * pte = hpt_lookup(proc_getas(), faultaddress);
+        paddr_t ori_pfn;
 
-        /* only copy valid translation(ie. virtual address page have a valid mapping to physical frame) */
-        if(pte != NULL) {
-            
-            vaddr_t alloc_vaddr = alloc_kpages(1);
+        /* write-protects the parent's copy; pages in swap come back in */
+        int result = vm_sharepage(old, faultaddress, &ori_pfn);
+        if(result == ENOENT) {
+            /* never touched, nothing to share */
+            continue;
+        }
 
-            if(alloc_vaddr == 0) {
-                return NULL;
+        if(result == 0) {
+            result = hpt_insert(newas, faultaddress, ori_pfn, 0);
+            if(result) {
+                free_kpages(PADDR_TO_KVADDR(ori_pfn));
             }
-
-            /* get PFN of the allocated frame */
-            paddr_t alloc_paddr = KVADDR_TO_PADDR(alloc_vaddr);
-            alloc_paddr = alloc_paddr & PAGE_FRAME;
-
-            paddr_t ori_pfn = pte->PFN;
-            
-            /* reset cache/dirty/valid bits */
-            ori_pfn &= ~TLBLO_NOCACHE;
-            ori_pfn &= ~TLBLO_DIRTY;
-            ori_pfn &= ~TLBLO_VALID;
-
-            /* use memmove instead of momcopy since this function will deal with overlapping */
-            memmove((void *)PADDR_TO_KVADDR(alloc_paddr), (void *)PADDR_TO_KVADDR(ori_pfn), PAGE_SIZE);
-
-            /* add to hpt_table */
-            hpt_insert(newas, pte->VPN, alloc_paddr, old_region->write);
+        }
+        if(result) {
+            /* pages already shared go when newas is destroyed */
+            region_destroy(new_region);
+            return NULL;
         }
     }
 
-    new_region->next = copy_region(newas, old_region->next);
-
     return new_region;
 }
 
 /*
  * region_mapping() - Used in vm_fault, to get corresponding region which contains the vaddr.
+ * Faults tend to come in runs on the same region, so the last hit is
+ * checked first; otherwise binary search the sorted region array.
  */
 struct region * 
 region_mapping(struct addrspace* as, vaddr_t fault_addr) 
 {
-    vaddr_t end;
+    struct region *reg = as->as_lasthit;
+    unsigned pos;
+
+    if(reg != NULL && fault_addr >= reg->vbase &&
+       fault_addr - reg->vbase < reg->npages * PAGE_SIZE) {
+        return reg;
+    }
 
-    if(as->regions == NULL) {
+    /* the candidate is the last region starting at or below fault_addr */
+    pos = region_search(as, fault_addr);
+    if(pos == 0) {
         return NULL;
     }
 
-    struct region * cur_region = as->regions;
-    while(cur_region != NULL) {
-        end = cur_region->vbase + cur_region->npages * PAGE_SIZE;
-        if (fault_addr >= cur_region->vbase && fault_addr < end) {
-            return cur_region;
-        }
-        cur_region = cur_region->next;
+    reg = regionarray_get(&as->regions, pos - 1);
+    if(fault_addr - reg->vbase < reg->npages * PAGE_SIZE) {
+        as->as_lasthit = reg;
+        return reg;
     }
 
     /* return NULL when cannot find one match */
     return NULL;
-}
\ No newline at end of file
+}
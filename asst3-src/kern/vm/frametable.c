@@ -4,6 +4,10 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <swap.h>
 
 /* Place your frametable data-structures here 
  * You probably also want to write a frametable initialisation
@@ -18,8 +22,122 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
  */
 static struct spinlock frametable_lock = SPINLOCK_INITIALIZER;
 
-/* first free frame in the frametable free list */
-static int first_free;
+/*
+ * Physical pages are handed out by a binary buddy allocator over the
+ * frametable. Free memory is kept as blocks of 2^order frames, each
+ * aligned to its own size, on one free list per order. Only the first
+ * frame of a block (its head) carries the order; the other frames of
+ * the block have order FT_NOTHEAD. A block's buddy is the block of the
+ * same size it was split from, whose index differs only in bit
+ * `order'; when both halves are free again they are merged.
+ *
+ * The free lists are doubly linked through the next/prev fields of the
+ * head frames so that a buddy can be unlinked in constant time.
+ */
+#define FT_MAXORDER 10                  /* largest block: 1024 pages */
+#define FT_NOTHEAD  (-1)
+
+/* number of frames managed */
+static int nframes;
+
+/* first free block on each order's free list, or -1 */
+static int free_head[FT_MAXORDER + 1];
+
+/* page replacement clock hand, protected by frametable_lock */
+static int clock_hand;
+
+/* fragmentation statistics, protected by frametable_lock */
+static unsigned ft_nblocks[FT_MAXORDER + 1];   /* free blocks per order */
+static unsigned ft_freepages;                   /* total free frames */
+static unsigned ft_wastepages;                  /* total lost to 2^order rounding */
+static unsigned ft_splits;
+static unsigned ft_merges;
+static unsigned ft_failures;                    /* requests we couldn't fill */
+
+/*
+ * Single pages don't go to the buddy allocator directly. Each cpu keeps
+ * a magazine of free frames in front of it; alloc_kpages(1) and the
+ * matching free_kpages() normally just pop and push the local
+ * magazine, and only take frametable_lock to move FT_MAGBATCH frames
+ * at a time between the magazine and the buddy free lists. Each
+ * magazine has its own lock, which is only contended when another cpu
+ * is short of memory and reclaims the cached frames.
+ *
+ * Frames sitting in a magazine look allocated (used, order 0) to the
+ * buddy allocator, with a reference count of 0.
+ *
+ * Lock order: magazine lock, then frametable_lock.
+ */
+#define FT_MAGSIZE  32
+#define FT_MAGBATCH 16
+
+struct ft_magazine {
+    struct spinlock fm_lock;
+    unsigned fm_count;
+    int fm_frames[FT_MAGSIZE];
+};
+
+static struct ft_magazine ft_mags[MAXCPUS];
+
+/*
+ * Reference counts of in-use frames are changed from any cpu without
+ * frametable_lock, so they are covered by a small array of striped
+ * locks instead, frame i by ft_reflocks[i % FT_NREFLOCKS].
+ */
+#define FT_NREFLOCKS 32
+
+static struct spinlock ft_reflocks[FT_NREFLOCKS];
+
+/*
+ * freelist_push() - put the free block starting at INDEX on its
+ * order's free list
+ */
+static
+void
+freelist_push(int index, int order)
+{
+    KASSERT(spinlock_do_i_hold(&frametable_lock));
+
+    frametable[index].used = false;
+    frametable[index].order = order;
+    frametable[index].prev = -1;
+    frametable[index].next = free_head[order];
+    if(free_head[order] != -1) {
+        frametable[free_head[order]].prev = index;
+    }
+    free_head[order] = index;
+
+    ft_nblocks[order]++;
+    ft_freepages += 1 << order;
+}
+
+/*
+ * freelist_remove() - take the free block starting at INDEX off its
+ * free list
+ */
+static
+void
+freelist_remove(int index)
+{
+    int order = frametable[index].order;
+
+    KASSERT(spinlock_do_i_hold(&frametable_lock));
+    KASSERT(!frametable[index].used);
+
+    if(frametable[index].prev == -1) {
+        free_head[order] = frametable[index].next;
+    }else {
+        frametable[frametable[index].prev].next = frametable[index].next;
+    }
+    if(frametable[index].next != -1) {
+        frametable[frametable[index].next].prev = frametable[index].prev;
+    }
+    frametable[index].next = -1;
+    frametable[index].prev = -1;
+
+    ft_nblocks[order]--;
+    ft_freepages -= 1 << order;
+}
 
 /*
  * frametable_bootstrap() - intialise frametable, called from vm_bootstrap 
@@ -30,8 +148,9 @@ frametable_bootstrap()
     paddr_t ram_size;
     paddr_t ram_first_free;
     size_t frametable_size;
-    int nframes;
+    struct frametable_entry *ft;
     int used;
+    int order;
 
     /* number of frames */
     ram_size = ram_getsize();
@@ -40,33 +159,250 @@ frametable_bootstrap()
     /* frametable size */
     frametable_size = nframes * sizeof(struct frametable_entry);
        
-    /* use existing bump allocator to allocate frametable */
-    frametable = (struct frametable_entry *)kmalloc(frametable_size);
+    /*
+     * use existing bump allocator to allocate frametable; don't
+     * publish it in the global until it is set up, since a non-NULL
+     * frametable switches alloc_kpages over to the buddy allocator
+     */
+    ft = (struct frametable_entry *)kmalloc(frametable_size);
+    if(ft == NULL) {
+        panic("frametable_bootstrap: Cannot allocate frametable\n");
+    }
     
     /* get the first free frame after os161 bootstrap */
     ram_first_free = ram_getfirstfree();
 
     /* calculate the number of used frames */
-    used = ram_first_free / PAGE_SIZE;
-
-    /* set first free frame index */
-    first_free = used;
+    used = DIVROUNDUP(ram_first_free, PAGE_SIZE);
 
-    /* initial frametable */
+    /* initial frametable: everything in use, one page at a time */
     for(int i = 0; i < nframes; i++) {
-        if(i < used) {
-            frametable[i].used = true;
-            frametable[i].next = -1;
-        }else {
-            frametable[i].used = false;
-            if(i == nframes - 1) {
-                frametable[i].next = -1;
-            }else {
-                frametable[i].next = i + 1;
-            }
-            
+        ft[i].used = true;
+        ft[i].next = -1;
+        ft[i].prev = -1;
+        ft[i].order = FT_NOTHEAD;
+        ft[i].refcount = 1;
+        ft[i].as = NULL;
+        ft[i].vpn = 0;
+        ft[i].swapslot = -1;
+        ft[i].busy = false;
+        ft[i].referenced = false;
+    }
+
+    for(int k = 0; k <= FT_MAXORDER; k++) {
+        free_head[k] = -1;
+    }
+
+    for(int i = 0; i < MAXCPUS; i++) {
+        spinlock_init(&ft_mags[i].fm_lock);
+        ft_mags[i].fm_count = 0;
+    }
+    for(int i = 0; i < FT_NREFLOCKS; i++) {
+        spinlock_init(&ft_reflocks[i]);
+    }
+
+    spinlock_acquire(&frametable_lock);
+    frametable = ft;
+
+    /* carve the free frames into the largest aligned blocks that fit */
+    for(int i = used; i < nframes; i += 1 << order) {
+        order = 0;
+        while(order < FT_MAXORDER &&
+              (i & ((1 << (order + 1)) - 1)) == 0 &&
+              i + (1 << (order + 1)) <= nframes) {
+            order++;
+        }
+        for(int j = i; j < i + (1 << order); j++) {
+            ft[j].used = false;
+            ft[j].refcount = 0;
+        }
+        freelist_push(i, order);
+    }
+    spinlock_release(&frametable_lock);
+}
+
+/*
+ * buddy_alloc() - take a free block of 2^ORDER frames, splitting a
+ * bigger one if necessary. Returns its first frame, or -1.
+ */
+static
+int
+buddy_alloc(int order)
+{
+    int k, index;
+
+    KASSERT(spinlock_do_i_hold(&frametable_lock));
+
+    /* smallest order with a free block that is big enough */
+    for(k = order; k <= FT_MAXORDER; k++) {
+        if(free_head[k] != -1) {
+            break;
+        }
+    }
+    if(k > FT_MAXORDER) {
+        return -1;
+    }
+
+    index = free_head[k];
+    freelist_remove(index);
+
+    /* give back the upper halves until the block is the right size */
+    while(k > order) {
+        k--;
+        freelist_push(index + (1 << k), k);
+        ft_splits++;
+    }
+
+    frametable[index].order = order;
+    for(int i = index; i < index + (1 << order); i++) {
+        frametable[i].used = true;
+        frametable[i].refcount = 1;
+    }
+    return index;
+}
+
+/*
+ * buddy_free() - return the block starting at INDEX, of 2^ORDER
+ * frames, merging it with its buddy for as long as the buddy is free
+ */
+static
+void
+buddy_free(int index, int order)
+{
+    int buddy;
+
+    KASSERT(spinlock_do_i_hold(&frametable_lock));
+
+    for(int i = index; i < index + (1 << order); i++) {
+        frametable[i].used = false;
+        frametable[i].refcount = 0;
+        frametable[i].order = FT_NOTHEAD;
+    }
+
+    while(order < FT_MAXORDER) {
+        buddy = index ^ (1 << order);
+        if(buddy + (1 << order) > nframes ||
+           frametable[buddy].used ||
+           frametable[buddy].order != order) {
+            break;
         }
+        freelist_remove(buddy);
+        frametable[buddy].order = FT_NOTHEAD;
+        if(buddy < index) {
+            index = buddy;
+        }
+        order++;
+        ft_merges++;
+    }
+
+    freelist_push(index, order);
+}
+
+
+/*
+ * mag_refill() - top up an empty magazine from the buddy allocator
+ */
+static
+void
+mag_refill(struct ft_magazine *mag)
+{
+    int index;
+
+    KASSERT(spinlock_do_i_hold(&mag->fm_lock));
+
+    spinlock_acquire(&frametable_lock);
+    while(mag->fm_count < FT_MAGBATCH) {
+        index = buddy_alloc(0);
+        if(index == -1) {
+            break;
+        }
+        frametable[index].refcount = 0;
+        mag->fm_frames[mag->fm_count++] = index;
+    }
+    spinlock_release(&frametable_lock);
+}
+
+/*
+ * mag_drain() - give up to COUNT frames from a magazine back to the
+ * buddy allocator
+ */
+static
+void
+mag_drain(struct ft_magazine *mag, unsigned count)
+{
+    KASSERT(spinlock_do_i_hold(&mag->fm_lock));
+
+    spinlock_acquire(&frametable_lock);
+    while(count > 0 && mag->fm_count > 0) {
+        buddy_free(mag->fm_frames[--mag->fm_count], 0);
+        count--;
     }
+    spinlock_release(&frametable_lock);
+}
+
+/*
+ * mag_reclaim() - empty every cpu's magazine into the buddy
+ * allocator, so their frames can be used (and merged) again. Called
+ * when an allocation is about to fail.
+ */
+static
+void
+mag_reclaim(void)
+{
+    for(int i = 0; i < MAXCPUS; i++) {
+        spinlock_acquire(&ft_mags[i].fm_lock);
+        mag_drain(&ft_mags[i], FT_MAGSIZE);
+        spinlock_release(&ft_mags[i].fm_lock);
+    }
+}
+
+/*
+ * mag_alloc() - get one frame from this cpu's magazine, refilling it
+ * from the buddy allocator if it is empty. Returns -1 if both are.
+ */
+static
+int
+mag_alloc(void)
+{
+    struct ft_magazine *mag;
+    int index = -1;
+
+    /*
+     * If we migrate after reading c_number we just use another cpu's
+     * magazine; the magazine lock keeps that correct.
+     */
+    mag = &ft_mags[curcpu->c_number];
+
+    spinlock_acquire(&mag->fm_lock);
+    if(mag->fm_count == 0) {
+        mag_refill(mag);
+    }
+    if(mag->fm_count > 0) {
+        index = mag->fm_frames[--mag->fm_count];
+        frametable[index].refcount = 1;
+    }
+    spinlock_release(&mag->fm_lock);
+
+    return index;
+}
+
+/*
+ * mag_free() - put a no longer referenced frame in this cpu's
+ * magazine, first draining a batch to the buddy allocator if it's full
+ */
+static
+void
+mag_free(int index)
+{
+    struct ft_magazine *mag = &ft_mags[curcpu->c_number];
+
+    spinlock_acquire(&mag->fm_lock);
+    if(mag->fm_count == FT_MAGSIZE) {
+        mag_drain(mag, FT_MAGBATCH);
+    }
+    frametable[index].order = 0;
+    mag->fm_frames[mag->fm_count++] = index;
+    spinlock_release(&mag->fm_lock);
 }
 
 
@@ -81,11 +417,8 @@ frametable_bootstrap()
 vaddr_t 
 alloc_kpages(unsigned int npages)
 {
-    /*
-     * IMPLEMENT ME.  You should replace this code with a proper
-     *        implementation.
-     */
     int index;
+    int order;
     vaddr_t addr;
     paddr_t paddr;
 
@@ -99,68 +432,321 @@ alloc_kpages(unsigned int npages)
         }
 
         addr = PADDR_TO_KVADDR(paddr);
-  
-    }else {
+        return addr;
+    }
 
-        /* use my allocator after frametable is initialised */
-        if(npages > 1) {
-            panic("Cannot deal with more than one page");
-        }
+    /* use my allocator after frametable is initialised */
+    order = 0;
+    while((1U << order) < npages) {
+        order++;
+    }
+    if(order > FT_MAXORDER) {
+        spinlock_acquire(&frametable_lock);
+        ft_failures++;
+        spinlock_release(&frametable_lock);
+        return 0;
+    }
 
+    if(order == 0) {
+        /* common case: single page from this cpu's magazine */
+        index = mag_alloc();
+    }else {
         spinlock_acquire(&frametable_lock);
+        index = buddy_alloc(order);
+        spinlock_release(&frametable_lock);
+    }
 
-        /* if there is no more free frame */
-        if(first_free == -1) {
-            spinlock_release(&frametable_lock);
-            return 0;
+    if(index == -1) {
+        /* frames may be parked in other cpus' magazines */
+        mag_reclaim();
+        spinlock_acquire(&frametable_lock);
+        index = buddy_alloc(order);
+        if(index == -1) {
+            ft_failures++;
         }
+        spinlock_release(&frametable_lock);
 
-        paddr = first_free << 12;
-        frametable[first_free].used = true;
-        
-        /* if this is the last free frame */
-        if(frametable[first_free].next == -1) {
-            first_free = -1;
-             
-        }else {
-            /* set to the next free frame */
-            index = first_free;
-            first_free = frametable[first_free].next;
-            frametable[index].next = -1;
+        /* if there is no free block big enough */
+        if(index == -1) {
+            return 0;
         }
+    }
 
-        /* find virtual address */
-        addr = PADDR_TO_KVADDR(paddr);
-
-        /* zero fill the frame */
-        bzero((void *)addr, PAGE_SIZE);
-        spinlock_release(&frametable_lock);      
+    if((1U << order) != npages) {
+        spinlock_acquire(&frametable_lock);
+        ft_wastepages += (1 << order) - npages;
+        spinlock_release(&frametable_lock);
     }
 
+    paddr = (paddr_t)index << 12;
+
+    /* find virtual address */
+    addr = PADDR_TO_KVADDR(paddr);
+
+    /* zero fill the frames; they're ours now, so no lock needed */
+    bzero((void *)addr, PAGE_SIZE << order);
+
     return addr;     
 }
 
 /*
- * free_kpages() - free pages, set used equal false 
+ * free_kpages() - drop one reference to a block of pages, and give
+ * it back to the allocator once nobody shares it any more
  */
 void 
 free_kpages(vaddr_t addr)
 {
-    spinlock_acquire(&frametable_lock);
+    int order;
+    struct spinlock *reflock;
 
     paddr_t paddr = KVADDR_TO_PADDR(addr);
 
     /* right shift the physical address to get the index of the frame table */
     int index = paddr >> 12;
 
+    reflock = &ft_reflocks[index % FT_NREFLOCKS];
+    spinlock_acquire(reflock);
+
     if(!frametable[index].used) {
-        spinlock_release(&frametable_lock);
+        spinlock_release(reflock);
         return;
     }
-    
-    frametable[index].used = false;
-    frametable[index].next = first_free;
-    first_free = index;
+
+    /* still mapped copy-on-write by someone else */
+    KASSERT(frametable[index].refcount > 0);
+    frametable[index].refcount--;
+    if(frametable[index].refcount > 0) {
+        spinlock_release(reflock);
+        return;
+    }
+    spinlock_release(reflock);
+
+    /*
+     * Nobody maps the frame any more; forget its owner so the clock
+     * won't pick it, and its copy in swap, which is now garbage.
+     */
+    frametable[index].as = NULL;
+    frametable[index].referenced = false;
+    if(frametable[index].swapslot >= 0) {
+        swap_free(frametable[index].swapslot);
+        frametable[index].swapslot = -1;
+    }
+
+    /*
+     * pages stolen before the frametable existed don't record an
+     * order; they are given back one page at a time
+     */
+    order = frametable[index].order;
+    if(order == FT_NOTHEAD) {
+        order = 0;
+    }
+    KASSERT((index & ((1 << order) - 1)) == 0);
+
+    if(order == 0) {
+        mag_free(index);
+    }else {
+        spinlock_acquire(&frametable_lock);
+        buddy_free(index, order);
+        spinlock_release(&frametable_lock);
+    }
+}
+
+/*
+ * frametable_printstats() - print free memory broken down by block
+ * size, for the kernel menu
+ */
+void
+frametable_printstats(void)
+{
+    unsigned nblocks[FT_MAXORDER + 1];
+    unsigned freepages, splits, merges, failures, waste;
+    unsigned cached = 0;
+    int largest = -1;
+
+    /* racy snapshot, good enough for statistics */
+    for(int i = 0; i < MAXCPUS; i++) {
+        cached += ft_mags[i].fm_count;
+    }
+
+    spinlock_acquire(&frametable_lock);
+    for(int k = 0; k <= FT_MAXORDER; k++) {
+        nblocks[k] = ft_nblocks[k];
+        if(nblocks[k] > 0) {
+            largest = k;
+        }
+    }
+    freepages = ft_freepages;
+    splits = ft_splits;
+    merges = ft_merges;
+    failures = ft_failures;
+    waste = ft_wastepages;
     spinlock_release(&frametable_lock);
+
+    kprintf("frametable: %u of %d frames free, %u more cached per-cpu\n",
+        freepages, nframes, cached);
+    for(int k = 0; k <= FT_MAXORDER; k++) {
+        kprintf("frametable:   order %2d (%4d pages): %u free blocks\n",
+            k, 1 << k, nblocks[k]);
+    }
+    if(largest >= 0) {
+        /*
+         * External fragmentation: the share of free memory that can't
+         * be used for a request as big as the largest free block.
+         */
+        kprintf("frametable: largest free block %d pages, "
+            "fragmentation %u%%\n", 1 << largest,
+            freepages == 0 ? 0 :
+            100 - (100 * (nblocks[largest] << largest)) / freepages);
+    }
+    kprintf("frametable: %u splits, %u merges, %u failed requests\n",
+        splits, merges, failures);
+    kprintf("frametable: %u pages lost to power-of-two rounding "
+        "since boot\n", waste);
 }
 
+/*
+ * frame_incref() - add a reference to an in-use frame, for sharing it
+ * copy-on-write between address spaces
+ */
+void
+frame_incref(paddr_t paddr)
+{
+    int index = paddr >> 12;
+    struct spinlock *reflock = &ft_reflocks[index % FT_NREFLOCKS];
+
+    spinlock_acquire(reflock);
+    KASSERT(frametable[index].used);
+    KASSERT(frametable[index].refcount > 0);
+    frametable[index].refcount++;
+    spinlock_release(reflock);
+}
+
+/*
+ * frame_getref() - number of references to a frame
+ */
+unsigned
+frame_getref(paddr_t paddr)
+{
+    int index = paddr >> 12;
+    struct spinlock *reflock = &ft_reflocks[index % FT_NREFLOCKS];
+    unsigned ret;
+
+    spinlock_acquire(reflock);
+    ret = frametable[index].refcount;
+    spinlock_release(reflock);
+
+    return ret;
+}
+
+/*
+ * frametable_freecount() - number of free frames, including those
+ * cached per-cpu. Only a snapshot.
+ */
+unsigned
+frametable_freecount(void)
+{
+    unsigned count = ft_freepages;
+
+    for(int i = 0; i < MAXCPUS; i++) {
+        count += ft_mags[i].fm_count;
+    }
+    return count;
+}
+
+/*
+ * frame_setowner() - record which page of which address space a user
+ * frame holds, making it a candidate for eviction, and the swap slot
+ * (or -1) that holds an up-to-date copy of it
+ */
+void
+frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vpn, int swapslot)
+{
+    int index = paddr >> 12;
+
+    KASSERT(frametable[index].used);
+    frametable[index].vpn = vpn;
+    frametable[index].swapslot = swapslot;
+    frametable[index].referenced = true;
+    frametable[index].as = as;
+}
+
+/*
+ * frame_touch() - note that a frame was just loaded into the TLB; the
+ * clock gives referenced frames a second chance. A frame mapped by a
+ * single address space also (re)learns its owner here, since after a
+ * copy-on-write split the remaining sharer isn't necessarily the one
+ * recorded.
+ */
+void
+frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vpn)
+{
+    int index = paddr >> 12;
+
+    frametable[index].referenced = true;
+    if(frametable[index].refcount == 1 && frametable[index].as != as) {
+        frametable[index].vpn = vpn;
+        frametable[index].as = as;
+    }
+}
+
+/*
+ * frame_pickvictim() - choose a frame to evict with the clock (second
+ * chance) algorithm. We have no hardware reference bit; instead a
+ * frame is marked referenced every time it is loaded into the TLB
+ * (frame_touch), which samples how often it's used. Only frames with
+ * a single owner are considered. The chosen frame is marked busy and
+ * its owner returned; the caller must verify the mapping still exists
+ * and call frame_unbusy when done. Returns the frame, or 0 if nothing
+ * can be evicted.
+ */
+paddr_t
+frame_pickvictim(struct addrspace **as, vaddr_t *vpn, int *swapslot)
+{
+    struct frametable_entry *fe;
+    paddr_t ret = 0;
+
+    spinlock_acquire(&frametable_lock);
+
+    /* two sweeps: the first may only be clearing reference bits */
+    for(int n = 0; n < 2 * nframes; n++) {
+        fe = &frametable[clock_hand];
+        if(fe->used && fe->as != NULL && !fe->busy && fe->refcount == 1) {
+            if(fe->referenced) {
+                fe->referenced = false;
+            }else {
+                fe->busy = true;
+                *as = fe->as;
+                *vpn = fe->vpn;
+                *swapslot = fe->swapslot;
+                ret = (paddr_t)clock_hand << 12;
+            }
+        }
+        clock_hand = (clock_hand + 1) % nframes;
+        if(ret != 0) {
+            break;
+        }
+    }
+
+    spinlock_release(&frametable_lock);
+    return ret;
+}
+
+/*
+ * frame_unbusy() - finish with a frame picked by frame_pickvictim. If
+ * EVICTED, its contents now live in SWAPSLOT and the frame is handed
+ * over to the caller as a fresh, unowned page.
+ */
+void
+frame_unbusy(paddr_t paddr, bool evicted)
+{
+    int index = paddr >> 12;
+
+    spinlock_acquire(&frametable_lock);
+    if(evicted) {
+        frametable[index].as = NULL;
+        frametable[index].swapslot = -1;
+        frametable[index].referenced = false;
+    }
+    frametable[index].busy = false;
+    spinlock_release(&frametable_lock);
+}
@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -121,6 +124,16 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * The per-cpu magazines (see below) hand out blocks without going
+ * through subpage_kmalloc, so they would skip the guard bands and
+ * labels and hide blocks from the consistency checks. Turn them off
+ * when debugging the heap.
+ */
+#if !defined(SLOW) && !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -160,36 +173,93 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages and their freelists. Most kmalloc
+ * and kfree calls don't get this far, though: they are satisfied
+ * from the per-cpu magazines below, and only come here to move a
+ * batch of blocks at a time.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Page map: for every physical page, the pageref of the subpage heap
+ * page there, or NULL if it isn't one. This lets kfree find a block's
+ * page, and from it the block size, in constant time and without
+ * taking kmalloc_spinlock. Entries are set and cleared under
+ * kmalloc_spinlock when a heap page is created or released; kfree
+ * reads them without it, which is safe because the page of a live
+ * block can't go away.
+ */
+static struct pageref **kheap_pagemap;
+static unsigned kheap_npages;
+
+////////////////////////////////////////
+
+#ifdef MAGAZINES
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a small stack of free blocks of each size. kmalloc
+ * and kfree normally just pop and push the local magazine under its
+ * own spinlock, which other cpus only take to print stats or to
+ * drain the magazines when memory runs out. When a magazine runs dry
+ * or overflows, half of it is refilled from, or returned to, the heap
+ * pages in one trip under kmalloc_spinlock.
+ *
+ * Blocks sitting in a magazine look allocated to the subpage
+ * allocator, so a page stays around while any of its blocks are
+ * cached. kfree fills blocks with 0xdeadbeef before caching them.
+ *
+ * A magazine lock and kmalloc_spinlock are never held together, and
+ * neither is held across alloc_kpages or free_kpages.
+ */
+#define KM_MAGMAX 16
+
+struct km_magazine {
+	struct spinlock km_lock;
+	unsigned km_count[NSIZES];
+	void *km_blocks[NSIZES][KM_MAGMAX];
+	unsigned km_hits;
+	unsigned km_misses;
+	unsigned km_flushes;
+};
+
+static struct km_magazine km_mags[MAXCPUS];
+
+#endif /* MAGAZINES */
+
 ////////////////////////////////////////
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * This is a struct type for such a page. The first slot holds a
+ * pointer back to the page's root, so freepageref can find it.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Each pageref page contains 255 pagerefs, which can manage up to
+ * 255 * 4K (nearly 1M) of kernel heap.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+struct kheap_root;
+
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(struct pageref)) / sizeof(struct pageref))
 
 struct pagerefpage {
+	union {
+		struct kheap_root *root;
+		struct pageref pad;
+	} hdr;
 	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
 /*
  * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
+ * bitmap of free entries. Bits past NPAGEREFS_PER_PAGE in the last
+ * word are kept set.
  */
 
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS_PER_PAGE, 32)
 
 struct kheap_root {
 	struct pagerefpage *page;
@@ -198,19 +268,22 @@ struct kheap_root {
 };
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
+ * There is one root for every NPAGEREFS_PER_PAGE pages of RAM, which
+ * is enough to track a heap as big as memory. The roots are sized
+ * from ram_getsize() and set up along with the page map (see
+ * kheap_initmap); the pageref pages themselves are only allocated
+ * when first needed.
  *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * kheap_rootsfree is a bitmap over the roots, with a bit set for each
+ * root that still has a free pageref, so allocpageref can skip full
+ * roots 32 at a time.
  */
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+static struct kheap_root *kheaproots;
+static unsigned kheap_nroots;
+static uint32_t *kheap_rootsfree;
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+#define TOTAL_PAGEREFS (kheap_nroots * NPAGEREFS_PER_PAGE)
 
 /*
  * Allocate a page to hold pagerefs.
@@ -248,6 +321,7 @@ allocpagerefpage(struct kheap_root *root)
 	}
 
 	root->page = (struct pagerefpage *)va;
+	root->page->hdr.root = root;
 }
 
 /*
@@ -257,40 +331,50 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	unsigned w, i, j;
+	uint32_t k, rootbit;
 	unsigned whichroot;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (w=0; w < DIVROUNDUP(kheap_nroots, 32); w++) {
+		if (kheap_rootsfree[w] == 0) {
+			/* 32 full roots */
 			continue;
 		}
+		whichroot = w*32;
+		for (rootbit=1; (kheap_rootsfree[w] & rootbit)==0; rootbit<<=1) {
+			whichroot++;
+		}
+		root = &kheaproots[whichroot];
+		KASSERT(whichroot < kheap_nroots);
+		KASSERT(root->numinuse < NPAGEREFS_PER_PAGE);
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+		for (i=0; root->pagerefs_inuse[i]==0xffffffff; i++) {
+			KASSERT(i < INUSE_WORDS - 1);
+		}
+		for (k=1,j=0; (root->pagerefs_inuse[i] & k)!=0; k<<=1,j++) {
+			/* nothing */
+		}
+
+		root->pagerefs_inuse[i] |= k;
+		root->numinuse++;
+		if (root->numinuse == NPAGEREFS_PER_PAGE) {
+			kheap_rootsfree[w] &= ~rootbit;
 		}
+
+		if (root->page == NULL) {
+			allocpagerefpage(root);
+		}
+		if (root->page == NULL) {
+			/* give the slot back */
+			root->pagerefs_inuse[i] &= ~k;
+			root->numinuse--;
+			kheap_rootsfree[w] |= rootbit;
+			return NULL;
+		}
+		return &root->page->refs[i*32 + j];
 	}
 
 	/* ran out */
@@ -310,30 +394,25 @@ freepageref(struct pageref *p)
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	page = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	root = page->hdr.root;
+	KASSERT(root >= kheaproots && root < kheaproots + kheap_nroots);
+	KASSERT(root->page == page);
+
+	j = p - page->refs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((root->pagerefs_inuse[i] & k) != 0);
+	root->pagerefs_inuse[i] &= ~k;
+	KASSERT(root->numinuse > 0);
+	root->numinuse--;
+
+	whichroot = root - kheaproots;
+	kheap_rootsfree[whichroot/32] |= ((uint32_t)1) << (whichroot%32);
 }
 
 ////////////////////////////////////////
@@ -347,6 +426,110 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+/*
+ * Set up the page map and the pageref roots, sized from the amount
+ * of RAM. This is done when the first heap page is made, which is
+ * early in boot, before the VM system takes over memory.
+ *
+ * Only one cpu is running this early, so calling ram_stealmem under
+ * kmalloc_spinlock is safe.
+ */
+static
+void
+kheap_initmap(void)
+{
+	size_t mapbytes, rootbytes, freebytes;
+	unsigned npages, nroots, i;
+	paddr_t pa;
+	vaddr_t va;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
+
+	if (kheap_pagemap != NULL) {
+		return;
+	}
+
+	npages = ram_getsize() / PAGE_SIZE;
+	if (npages == 0) {
+		panic("kmalloc: heap set up after the VM system started\n");
+	}
+	nroots = DIVROUNDUP(npages, NPAGEREFS_PER_PAGE);
+
+	mapbytes = npages * sizeof(struct pageref *);
+	rootbytes = nroots * sizeof(struct kheap_root);
+	freebytes = DIVROUNDUP(nroots, 32) * sizeof(uint32_t);
+	pa = ram_stealmem(DIVROUNDUP(mapbytes + rootbytes + freebytes,
+				     PAGE_SIZE));
+	if (pa == 0) {
+		panic("kmalloc: No memory for the heap page map\n");
+	}
+	va = PADDR_TO_KVADDR(pa);
+	bzero((void *)va, mapbytes + rootbytes + freebytes);
+
+	kheaproots = (struct kheap_root *)(va + mapbytes);
+	kheap_rootsfree = (uint32_t *)(va + mapbytes + rootbytes);
+	for (i=0; i<nroots; i++) {
+		if (NPAGEREFS_PER_PAGE % 32 != 0) {
+			kheaproots[i].pagerefs_inuse[INUSE_WORDS - 1] =
+				~((((uint32_t)1) << (NPAGEREFS_PER_PAGE % 32)) - 1);
+		}
+		kheap_rootsfree[i/32] |= ((uint32_t)1) << (i%32);
+	}
+	kheap_nroots = nroots;
+
+#ifdef MAGAZINES
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&km_mags[i].km_lock);
+	}
+#endif
+
+	kheap_npages = npages;
+	kheap_pagemap = (struct pageref **)va;
+}
+
+/*
+ * Record the pageref of a heap page, or NULL when it stops being one.
+ */
+static
+void
+kheap_setpageref(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned idx;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(kheap_pagemap != NULL);
+
+	idx = KVADDR_TO_PADDR(prpage) / PAGE_SIZE;
+	KASSERT(idx < kheap_npages);
+	kheap_pagemap[idx] = pr;
+}
+
+/*
+ * Return the pageref of the heap page ADDR is on, or NULL if it is
+ * not on a heap page.
+ */
+static
+struct pageref *
+kheap_getpageref(vaddr_t addr)
+{
+	unsigned idx;
+
+	if (kheap_pagemap == NULL) {
+		/* no heap pages yet */
+		return NULL;
+	}
+
+	/* addresses below kseg0 wrap around and fail the bounds check */
+	idx = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (idx >= kheap_npages) {
+		return NULL;
+	}
+	return kheap_pagemap[idx];
+}
+
+////////////////////////////////////////
+
 #ifdef GUARDS
 
 /* Space returned to the client is filled with GUARD_RETBYTE */
@@ -794,6 +977,40 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+/*
+ * Print the magazine counters of each cpu that has used them.
+ */
+static
+void
+km_printstats(void)
+{
+	struct km_magazine *mag;
+	unsigned i, cached;
+	int blktype;
+
+	if (kheap_pagemap == NULL) {
+		return;
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		mag = &km_mags[i];
+		spinlock_acquire(&mag->km_lock);
+		if (mag->km_hits + mag->km_misses > 0) {
+			cached = 0;
+			for (blktype=0; blktype<NSIZES; blktype++) {
+				cached += mag->km_count[blktype];
+			}
+			kprintf("cpu%u magazines: %u hits, %u misses, "
+				"%u flushes, %u blocks cached\n",
+				i, mag->km_hits, mag->km_misses,
+				mag->km_flushes, cached);
+		}
+		spinlock_release(&mag->km_lock);
+	}
+}
+#endif /* MAGAZINES */
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +1029,10 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	km_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -866,6 +1087,95 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take the first block off PR's freelist.
+ */
+static
+void *
+subpage_popblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at OFFSET on PR's page back on its freelist. If that
+ * makes the whole page free, take the page off the lists and return
+ * true; the caller must then free_kpages it after releasing
+ * kmalloc_spinlock.
+ */
+static
+bool
+subpage_pushblock(struct pageref *pr, int blktype, vaddr_t offset)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		kheap_setpageref(prpage, NULL);
+		return true;
+	}
+	return false;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -921,25 +1231,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_popblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -977,6 +1269,8 @@ subpage_kmalloc(size_t sz
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
+	kheap_initmap();
+
 	pr = allocpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
@@ -1013,6 +1307,8 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	kheap_setpageref(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -1029,8 +1325,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1065,30 +1359,20 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = kheap_getpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1113,35 +1397,7 @@ subpage_kfree(void *ptr)
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_pushblock(pr, blktype, offset)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1159,6 +1415,247 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+#ifdef MAGAZINES
+
+/*
+ * Number of blocks of type BLKTYPE a magazine holds: KM_MAGMAX, but
+ * never more than a page's worth. Refills and flushes move half that.
+ */
+static
+unsigned
+km_magsize(int blktype)
+{
+	unsigned n;
+
+	n = PAGE_SIZE / sizes[blktype];
+	return n < KM_MAGMAX ? n : KM_MAGMAX;
+}
+
+static
+unsigned
+km_batch(int blktype)
+{
+	unsigned n;
+
+	n = km_magsize(blktype) / 2;
+	return n > 0 ? n : 1;
+}
+
+/*
+ * Get the current cpu's magazine, or NULL if there isn't one yet.
+ */
+static
+struct km_magazine *
+km_curmag(void)
+{
+	if (kheap_pagemap == NULL || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+	KASSERT(curcpu->c_number < MAXCPUS);
+	return &km_mags[curcpu->c_number];
+}
+
+/*
+ * Take up to MAX free blocks of type BLKTYPE off the existing heap
+ * pages. Doesn't make new pages. Returns the number found.
+ */
+static
+unsigned
+subpage_getbatch(int blktype, void **blocks, unsigned max)
+{
+	struct pageref *pr;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = sizebases[blktype]; pr != NULL && n < max;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+		while (pr->nfree > 0 && n < max) {
+			blocks[n++] = subpage_popblock(pr);
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
+/*
+ * Return N blocks of type BLKTYPE from a magazine to their pages,
+ * releasing any pages that become completely free.
+ */
+static
+void
+subpage_putbatch(int blktype, void **blocks, unsigned n)
+{
+	vaddr_t freepages[KM_MAGMAX];
+	unsigned nfreepages, i;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage;
+
+	KASSERT(n <= KM_MAGMAX);
+
+	nfreepages = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = kheap_getpageref(ptraddr);
+		KASSERT(pr != NULL);
+		KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+		prpage = PR_PAGEADDR(pr);
+		if (subpage_pushblock(pr, blktype, ptraddr - prpage)) {
+			freepages[nfreepages++] = prpage;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from the current cpu's magazine,
+ * refilling it from the heap pages if it's empty. Returns NULL if
+ * there's no magazine or no free block on any existing page; the
+ * caller then goes to subpage_kmalloc, which makes a new page.
+ */
+static
+void *
+km_alloc(int blktype)
+{
+	struct km_magazine *mag;
+	void *blocks[KM_MAGMAX];
+	unsigned n, cap;
+	void *ret;
+
+	mag = km_curmag();
+	if (mag == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&mag->km_lock);
+	if (mag->km_count[blktype] > 0) {
+		ret = mag->km_blocks[blktype][--mag->km_count[blktype]];
+		mag->km_hits++;
+		spinlock_release(&mag->km_lock);
+		return ret;
+	}
+	mag->km_misses++;
+	spinlock_release(&mag->km_lock);
+
+	n = subpage_getbatch(blktype, blocks, km_batch(blktype));
+	if (n == 0) {
+		return NULL;
+	}
+	ret = blocks[--n];
+
+	if (n > 0) {
+		/*
+		 * We may have migrated or the magazine may have been
+		 * refilled meanwhile; stash what fits and give back
+		 * the rest.
+		 */
+		cap = km_magsize(blktype);
+		spinlock_acquire(&mag->km_lock);
+		while (n > 0 && mag->km_count[blktype] < cap) {
+			mag->km_blocks[blktype][mag->km_count[blktype]++] =
+				blocks[--n];
+		}
+		spinlock_release(&mag->km_lock);
+		if (n > 0) {
+			subpage_putbatch(blktype, blocks, n);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Free a block of type BLKTYPE into the current cpu's magazine,
+ * sending half of it back to the heap pages if it's full. Returns
+ * false if there's no magazine to use.
+ */
+static
+bool
+km_free(void *ptr, int blktype)
+{
+	struct km_magazine *mag;
+	void *blocks[KM_MAGMAX];
+	unsigned n, cap, top;
+
+	/* Check for proper alignment */
+	if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	mag = km_curmag();
+	if (mag == NULL) {
+		return false;
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	cap = km_magsize(blktype);
+	spinlock_acquire(&mag->km_lock);
+	top = mag->km_count[blktype];
+
+	/* check just the most recent free, like subpage_kfree does */
+	KASSERT(top == 0 || mag->km_blocks[blktype][top - 1] != ptr);
+
+	if (top < cap) {
+		mag->km_blocks[blktype][top] = ptr;
+		mag->km_count[blktype] = top + 1;
+		spinlock_release(&mag->km_lock);
+		return true;
+	}
+
+	n = km_batch(blktype);
+	top -= n;
+	memcpy(blocks, &mag->km_blocks[blktype][top], n * sizeof(void *));
+	mag->km_blocks[blktype][top] = ptr;
+	mag->km_count[blktype] = top + 1;
+	mag->km_flushes++;
+	spinlock_release(&mag->km_lock);
+
+	subpage_putbatch(blktype, blocks, n);
+	return true;
+}
+
+/*
+ * Empty every cpu's magazines back into the heap pages, so pages
+ * that are only held by cached blocks can be released. Used when
+ * we can't get a fresh page.
+ */
+static
+void
+km_drainall(void)
+{
+	struct km_magazine *mag;
+	void *blocks[KM_MAGMAX];
+	unsigned i, n;
+	int blktype;
+
+	if (kheap_pagemap == NULL) {
+		return;
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		mag = &km_mags[i];
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			spinlock_acquire(&mag->km_lock);
+			n = mag->km_count[blktype];
+			memcpy(blocks, mag->km_blocks[blktype],
+			       n * sizeof(void *));
+			mag->km_count[blktype] = 0;
+			spinlock_release(&mag->km_lock);
+			if (n > 0) {
+				subpage_putbatch(blktype, blocks, n);
+			}
+		}
+	}
+}
+
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1198,7 +1695,23 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-#ifdef LABELS
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = km_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+		ptr = subpage_kmalloc(sz);
+		if (ptr == NULL && kheap_pagemap != NULL) {
+			/* Cached blocks may be pinning pages; retry once. */
+			km_drainall();
+			ptr = subpage_kmalloc(sz);
+		}
+		return ptr;
+	}
+#elif defined(LABELS)
 	return subpage_kmalloc(sz, label);
 #else
 	return subpage_kmalloc(sz);
@@ -1216,7 +1729,24 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (kheap_pagemap != NULL) {
+		struct pageref *pr;
+
+		/* The page map says which it is without a search. */
+		pr = kheap_getpageref((vaddr_t)ptr);
+		if (pr == NULL) {
+			KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+			free_kpages((vaddr_t)ptr);
+			return;
+		}
+		if (km_free(ptr, PR_BLOCKTYPE(pr))) {
+			return;
+		}
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
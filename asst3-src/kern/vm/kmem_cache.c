@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Object caches. See kmem_cache.h for the interface.
+ *
+ * Each slab is one page from alloc_kpages. The objects are laid out
+ * from the start of the page and the slab header sits at the end,
+ * so the slab of any object is found by rounding its address. Free
+ * objects that have never been constructed (or have been destroyed)
+ * are kept on a freelist in their slab, linked through their first
+ * word. Slabs with at least one such object are on the cache's
+ * partial list; a slab is freed as soon as none of its objects are
+ * in use.
+ *
+ * Freed objects that are still constructed can't be linked through
+ * their first word, so the cache keeps up to KC_MAXIDLE pointers to
+ * them in an array. kmem_cache_alloc takes from there first; once it
+ * is full, kmem_cache_free destroys the object and returns it to its
+ * slab.
+ *
+ * Each cache has a spinlock, which is never held across the
+ * constructor, the destructor, alloc_kpages or free_kpages. The list
+ * of all caches has its own spinlock, taken before a cache's lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+#define KC_MAXIDLE	16	/* constructed free objects kept per cache */
+#define KC_ALIGN	8	/* object alignment */
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* on kc_partial */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;	/* owning cache */
+	void *ks_free;			/* unconstructed free objects */
+	unsigned ks_inuse;		/* objects not on ks_free */
+};
+
+#define SLAB_OF(obj) ((struct kmem_slab *)(((vaddr_t)(obj) & PAGE_FRAME) \
+			+ PAGE_SIZE - sizeof(struct kmem_slab)))
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, after alignment */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	unsigned kc_nidle;		/* entries in kc_idle */
+	void *kc_idle[KC_MAXIDLE];	/* free, still constructed */
+
+	/* statistics */
+	unsigned kc_nslabs;		/* slabs held */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_allocs;		/* kmem_cache_alloc calls */
+	unsigned kc_reuses;		/* ... satisfied from kc_idle */
+	unsigned kc_ctors;		/* constructor calls */
+	unsigned kc_dtors;		/* destructor calls */
+	unsigned kc_fails;		/* failed allocations */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+////////////////////////////////////////////////////////////
+// Slabs
+
+/*
+ * Turn the page at PAGE into an empty slab for KC and put it on the
+ * partial list.
+ */
+static
+void
+kmem_slab_init(struct kmem_cache *kc, vaddr_t page)
+{
+	struct kmem_slab *slab;
+	vaddr_t obj;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+	KASSERT(page % PAGE_SIZE == 0);
+
+	slab = SLAB_OF(page);
+	slab->ks_cache = kc;
+	slab->ks_inuse = 0;
+	slab->ks_free = NULL;
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = page + i * kc->kc_size;
+		*(void **)obj = slab->ks_free;
+		slab->ks_free = (void *)obj;
+	}
+
+	slab->ks_prev = NULL;
+	slab->ks_next = kc->kc_partial;
+	if (kc->kc_partial != NULL) {
+		kc->kc_partial->ks_prev = slab;
+	}
+	kc->kc_partial = slab;
+	kc->kc_nslabs++;
+}
+
+/*
+ * Take a slab off the partial list.
+ */
+static
+void
+kmem_slab_unlink(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	if (slab->ks_prev != NULL) {
+		slab->ks_prev->ks_next = slab->ks_next;
+	}
+	else {
+		KASSERT(kc->kc_partial == slab);
+		kc->kc_partial = slab->ks_next;
+	}
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_prev = slab->ks_prev;
+	}
+	slab->ks_next = slab->ks_prev = NULL;
+}
+
+/*
+ * Take an unconstructed object from a partial slab, or return NULL
+ * if there are none.
+ */
+static
+void *
+kmem_slab_take(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	slab = kc->kc_partial;
+	if (slab == NULL) {
+		return NULL;
+	}
+	obj = slab->ks_free;
+	KASSERT(obj != NULL);
+	slab->ks_free = *(void **)obj;
+	slab->ks_inuse++;
+	if (slab->ks_free == NULL) {
+		kmem_slab_unlink(kc, slab);
+	}
+	return obj;
+}
+
+/*
+ * Put an unconstructed object back in its slab. If the slab is now
+ * empty, it is taken off the cache and its page returned; the caller
+ * must free_kpages it after releasing the cache lock. Otherwise
+ * returns 0.
+ */
+static
+vaddr_t
+kmem_slab_give(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab;
+	bool wasfull;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	slab = SLAB_OF(obj);
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(slab->ks_inuse > 0);
+
+	wasfull = (slab->ks_free == NULL);
+	*(void **)obj = slab->ks_free;
+	slab->ks_free = obj;
+	slab->ks_inuse--;
+
+	if (slab->ks_inuse == 0) {
+		if (!wasfull) {
+			kmem_slab_unlink(kc, slab);
+		}
+		kc->kc_nslabs--;
+		return (vaddr_t)obj & PAGE_FRAME;
+	}
+	if (wasfull) {
+		slab->ks_prev = NULL;
+		slab->ks_next = kc->kc_partial;
+		if (kc->kc_partial != NULL) {
+			kc->kc_partial->ks_prev = slab;
+		}
+		kc->kc_partial = slab;
+	}
+	return 0;
+}
+
+/*
+ * Destroy OBJ, if the cache has a destructor, and put it back in its
+ * slab, freeing the slab if it becomes empty.
+ */
+static
+void
+kmem_cache_release(struct kmem_cache *kc, void *obj, bool constructed)
+{
+	vaddr_t page;
+
+	if (constructed && kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	if (constructed && kc->kc_dtor != NULL) {
+		kc->kc_dtors++;
+	}
+	page = kmem_slab_give(kc, obj);
+	spinlock_release(&kc->kc_lock);
+
+	if (page != 0) {
+		free_kpages(page);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	KASSERT(name != NULL);
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, KC_ALIGN);
+	if (kc->kc_size < sizeof(void *)) {
+		kc->kc_size = sizeof(void *);
+	}
+	kc->kc_perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) / kc->kc_size;
+	if (kc->kc_perslab == 0) {
+		panic("kmem_cache_create: %s: objects of %zu bytes "
+		      "don't fit in a slab\n", name, size);
+	}
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_nidle = 0;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_reuses = 0;
+	kc->kc_ctors = 0;
+	kc->kc_dtors = 0;
+	kc->kc_fails = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	void *obj;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	/* Destroy the idle objects; that should empty every slab. */
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse == 0);
+	while (kc->kc_nidle > 0) {
+		obj = kc->kc_idle[--kc->kc_nidle];
+		spinlock_release(&kc->kc_lock);
+		kmem_cache_release(kc, obj, true);
+		spinlock_acquire(&kc->kc_lock);
+	}
+	KASSERT(kc->kc_nslabs == 0);
+	KASSERT(kc->kc_partial == NULL);
+	spinlock_release(&kc->kc_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+	vaddr_t page;
+	int result;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nidle > 0) {
+		/* Already constructed; hand it straight out. */
+		obj = kc->kc_idle[--kc->kc_nidle];
+		kc->kc_reuses++;
+		kc->kc_inuse++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+
+	obj = kmem_slab_take(kc);
+	while (obj == NULL) {
+		/* Release the lock to get a page; recheck afterwards. */
+		spinlock_release(&kc->kc_lock);
+		page = alloc_kpages(1);
+		spinlock_acquire(&kc->kc_lock);
+		if (page == 0) {
+			kc->kc_fails++;
+			spinlock_release(&kc->kc_lock);
+			return NULL;
+		}
+		if (kc->kc_partial != NULL) {
+			/* Somebody else made a slab meanwhile; use theirs. */
+			spinlock_release(&kc->kc_lock);
+			free_kpages(page);
+			spinlock_acquire(&kc->kc_lock);
+		}
+		else {
+			kmem_slab_init(kc, page);
+		}
+		obj = kmem_slab_take(kc);
+	}
+	kc->kc_inuse++;
+	if (kc->kc_ctor != NULL) {
+		kc->kc_ctors++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_ctor != NULL) {
+		result = kc->kc_ctor(obj);
+		if (result) {
+			spinlock_acquire(&kc->kc_lock);
+			kc->kc_inuse--;
+			kc->kc_fails++;
+			spinlock_release(&kc->kc_lock);
+			kmem_cache_release(kc, obj, false);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+	KASSERT(SLAB_OF(obj)->ks_cache == kc);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (kc->kc_nidle < KC_MAXIDLE) {
+		/* check just the most recent free, for double frees */
+		KASSERT(kc->kc_nidle == 0 ||
+			kc->kc_idle[kc->kc_nidle - 1] != obj);
+		kc->kc_idle[kc->kc_nidle++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	kmem_cache_release(kc, obj, true);
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kprintf("%-12s %5s %5s %6s %5s %8s %8s %6s %6s %5s\n",
+		"cache", "size", "slabs", "inuse", "idle", "allocs",
+		"reused", "ctors", "dtors", "fails");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("%-12s %5zu %5u %6u %5u %8u %8u %6u %6u %5u\n",
+			kc->kc_name, kc->kc_size, kc->kc_nslabs,
+			kc->kc_inuse, kc->kc_nidle, kc->kc_allocs,
+			kc->kc_reuses, kc->kc_ctors, kc->kc_dtors,
+			kc->kc_fails);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
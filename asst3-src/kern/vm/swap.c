@@ -0,0 +1,201 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <stat.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap space on a raw disk device, one page per slot.
+ */
+
+bool swap_enabled = false;
+struct lock *swap_lock;
+
+/* the raw swap device */
+static struct vnode *swap_vnode;
+
+/* one bit per slot, set if the slot holds a page */
+static struct bitmap *swap_map;
+static unsigned swap_total;
+static unsigned swap_used;
+
+/* protects swap_map and the counters */
+static struct spinlock swap_maplock = SPINLOCK_INITIALIZER;
+
+/* statistics */
+static unsigned swap_reads;
+static unsigned swap_writes;
+
+/*
+ * swap_bootstrap() - open the swap device. Missing swap isn't fatal;
+ * we just run without paging.
+ */
+void
+swap_bootstrap(void)
+{
+    struct stat st;
+    char path[sizeof(SWAP_DEVICE)];
+    int result;
+
+    swap_lock = lock_create("swap_lock");
+    if(swap_lock == NULL) {
+        panic("swap_bootstrap: Cannot create swap lock\n");
+    }
+
+    /* vfs_open mangles its argument */
+    strcpy(path, SWAP_DEVICE);
+    result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+    if(result) {
+        kprintf("swap: no swap device %s: %s; paging disabled\n",
+            SWAP_DEVICE, strerror(result));
+        return;
+    }
+
+    result = VOP_STAT(swap_vnode, &st);
+    if(result) {
+        kprintf("swap: cannot stat %s: %s; paging disabled\n",
+            SWAP_DEVICE, strerror(result));
+        vfs_close(swap_vnode);
+        return;
+    }
+
+    swap_total = st.st_size / PAGE_SIZE;
+    if(swap_total == 0) {
+        kprintf("swap: %s is too small; paging disabled\n", SWAP_DEVICE);
+        vfs_close(swap_vnode);
+        return;
+    }
+
+    swap_map = bitmap_create(swap_total);
+    if(swap_map == NULL) {
+        panic("swap_bootstrap: Cannot allocate swap bitmap\n");
+    }
+
+    swap_enabled = true;
+    kprintf("swap: %u pages on %s\n", swap_total, SWAP_DEVICE);
+}
+
+unsigned
+swap_nslots(void)
+{
+    return swap_enabled ? swap_total : 0;
+}
+
+/*
+ * swap_alloc() - reserve a free slot
+ */
+int
+swap_alloc(unsigned *slot)
+{
+    int result;
+
+    KASSERT(swap_enabled);
+
+    spinlock_acquire(&swap_maplock);
+    result = bitmap_alloc(swap_map, slot);
+    if(result == 0) {
+        swap_used++;
+    }
+    spinlock_release(&swap_maplock);
+
+    return result ? ENOSPC : 0;
+}
+
+/*
+ * swap_free() - release a slot
+ */
+void
+swap_free(unsigned slot)
+{
+    spinlock_acquire(&swap_maplock);
+    KASSERT(bitmap_isset(swap_map, slot));
+    bitmap_unmark(swap_map, slot);
+    swap_used--;
+    spinlock_release(&swap_maplock);
+}
+
+/*
+ * swap_io() - move one page between a frame and a slot
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    KASSERT(slot < swap_total);
+
+    uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+              (off_t)slot * PAGE_SIZE, rw);
+    if(rw == UIO_READ) {
+        result = VOP_READ(swap_vnode, &ku);
+    }else {
+        result = VOP_WRITE(swap_vnode, &ku);
+    }
+    if(result) {
+        return result;
+    }
+    if(ku.uio_resid != 0) {
+        return EIO;
+    }
+    return 0;
+}
+
+/*
+ * swap_in() - read the page stored in SLOT into the frame at PADDR
+ */
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+    spinlock_acquire(&swap_maplock);
+    swap_reads++;
+    spinlock_release(&swap_maplock);
+
+    return swap_io(slot, paddr, UIO_READ);
+}
+
+/*
+ * swap_out() - write the frame at PADDR to SLOT
+ */
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+    spinlock_acquire(&swap_maplock);
+    swap_writes++;
+    spinlock_release(&swap_maplock);
+
+    return swap_io(slot, paddr, UIO_WRITE);
+}
+
+/*
+ * swap_printstats() - print swap usage, for the kernel menu
+ */
+void
+swap_printstats(void)
+{
+    unsigned used, reads, writes;
+
+    if(!swap_enabled) {
+        kprintf("swap: disabled\n");
+        return;
+    }
+
+    spinlock_acquire(&swap_maplock);
+    used = swap_used;
+    reads = swap_reads;
+    writes = swap_writes;
+    spinlock_release(&swap_maplock);
+
+    kprintf("swap: %u of %u slots in use, %u page-ins, %u page-outs\n",
+        used, swap_total, reads, writes);
+}
@@ -10,15 +10,142 @@
 #include <spinlock.h>
 #include <current.h> 
 #include <proc.h>   
+#include <cpu.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
 
 /* Place your page table functions here */
 
+/*
+ * The hash pagetable is a single array of hpt_size entries allocated
+ * once at bootstrap, so the fault path doesn't normally call kmalloc
+ * or kfree (but see the overflow area below).
+ * Collisions are resolved by open addressing (linear probing) rather
+ * than by chaining separately allocated nodes.
+ *
+ * The array is cut into hpt_nparts equal partitions, each protected
+ * by its own spinlock, so that faults landing in different partitions
+ * proceed in parallel on different cpus. The hash picks a partition
+ * and a home slot within it, and probing wraps around inside that
+ * partition only, so one lock covers every slot a probe can touch.
+ *
+ * Deleted slots become tombstones (PID == HPT_DELETED) so that probe
+ * sequences stay intact and entries never move; a run of tombstones
+ * in front of an empty slot is turned back into empty slots.
+ *
+ * The array is sized for every page in memory or in swap, but with
+ * copy-on-write fork each sharer of a frame has its own entry, so a
+ * deep enough fork tree can fill a partition anyway. An entry that
+ * doesn't fit goes into the overflow area instead: chunks of
+ * HPT_OVFCHUNK entries, allocated as needed and never freed, with
+ * slot numbers from hpt_size up. Each partition chains its overflow
+ * entries from hpt_ovfhead[], under the partition lock; unused ones
+ * are on hpt_ovffree, under hpt_ovflock (taken inside a partition
+ * lock). Overflow slots never move either, so the as_next/as_prev
+ * lists work across both.
+ */
+#define HPT_NLOCKS 64           /* maximum number of partitions */
+#define HPT_MINPART 64          /* smallest partition worth its own lock */
+#define HPT_OVFCHUNK 256        /* overflow entries per chunk */
+#define HPT_MAXOVF 256          /* maximum number of overflow chunks */
+
+#define HPT_DELETED ((struct addrspace *)1)
+
+static struct spinlock hpt_locks[HPT_NLOCKS];
+static unsigned hpt_nparts;     /* number of partitions in use */
+static unsigned hpt_partsize;   /* slots per partition */
+
+struct hpt_ovfentry {
+    struct hpt_entry oe_pte;    /* the entry proper */
+    unsigned oe_part;           /* partition it belongs to */
+    int oe_next;                /* next in partition chain or free list */
+};
+
+static int hpt_ovfhead[HPT_NLOCKS];  /* per-partition overflow chains */
+static struct spinlock hpt_ovflock = SPINLOCK_INITIALIZER;
+static struct hpt_ovfentry *hpt_ovf[HPT_MAXOVF];
+static unsigned hpt_novf;       /* overflow chunks allocated */
+static int hpt_ovffree;         /* free overflow slots, or -1 */
+
+/*
+ * Fault counters. These are kept per-cpu so that counting a fault
+ * doesn't itself become a point of contention; vm_printstats sums
+ * them up. Each slot is only touched by its own cpu with interrupts
+ * off.
+ */
+struct vm_cpustats {
+    unsigned vs_faults;         /* total faults handled */
+    unsigned vs_readfaults;     /* VM_FAULT_READ */
+    unsigned vs_writefaults;    /* VM_FAULT_WRITE */
+    unsigned vs_newpages;       /* faults that allocated a frame */
+    unsigned vs_cowcopies;      /* copy-on-write faults that copied */
+    unsigned vs_cowreuses;      /* copy-on-write faults on a sole owner */
+    unsigned vs_pageins;        /* faults satisfied from swap */
+    unsigned vs_evictions;      /* frames reclaimed by page replacement */
+    unsigned vs_asidallocs;     /* ASIDs handed out */
+    unsigned vs_tlbflushes;     /* full TLB flushes on ASID wrap */
+};
+
+static struct vm_cpustats vm_stats[MAXCPUS];
+
+/* time of the last vm_resetstats, for computing fault throughput */
+static struct timespec vm_stats_start;
+
+/*
+ * ASID allocation. TLB entries are tagged with a 6-bit address space
+ * ID so that switching address spaces doesn't need a TLB flush.
+ * Each cpu has its own TLB and so its own ASID space: it hands out
+ * ASIDs 1..NUM_ASID-1 in order within a generation, and an address
+ * space remembers, per cpu, the ASID it got there tagged with that
+ * generation. When a cpu runs out it starts a new generation and
+ * flushes its TLB; that is the only time a context switch flushes.
+ * ASIDs are never reused within a generation, so entries left behind
+ * by a destroyed address space can't be matched by anyone else.
+ */
+#define ASID_MASK     (NUM_ASID - 1)
+#define ASID_GENSHIFT 6
+
+struct asid_cpu {
+    uint32_t ac_generation;     /* current generation on this cpu */
+    uint32_t ac_next;           /* next ASID to hand out */
+    uint32_t ac_curhi;          /* entryhi PID of the current ASID */
+};
+
+static struct asid_cpu asid_cpus[MAXCPUS];
+
+/*
+ * Page replacement. When free memory drops below VM_MINFREE frames,
+ * user page allocations evict a page to swap instead of taking one of
+ * the last free frames, which are left for the kernel heap (kmalloc
+ * can't wait for page-out).
+ */
+#define VM_MINFREE     16
+#define VM_EVICT_TRIES 8
+
+/*
+ * TLB shootdowns sent for a page-out, not yet acknowledged. The
+ * evictor (one at a time, under swap_lock) spins on this rather than
+ * sleeping, so that vm_tlbshootdown never has to wake a thread from
+ * inside the IPI handler.
+ */
+static struct spinlock vm_shootdown_lock = SPINLOCK_INITIALIZER;
+static int vm_shootdown_pending;
+
+static void hpt_link(struct addrspace *as, int slot);
+static void hpt_unlink(struct addrspace *as, int slot);
+static void hpt_remove(unsigned part, int slot);
+static void vm_tlbinvalidate_cpu(struct addrspace *as, vaddr_t VPN);
+
 uint32_t
 hpt_hash(struct addrspace *as, vaddr_t VPN) 
 {
     uint32_t index;
 
-    index = (((uint32_t)as) ^ VPN >> 12) % hpt_size;
+    /* multiplicative hash spreads nearby pages across partitions */
+    index = (((uint32_t)as) ^ (VPN >> 12)) * 2654435761U;
     return index;
 }
 
@@ -30,17 +157,192 @@ void
 hpt_bootstrap() 
 {
     paddr_t top_of_ram = ram_getsize();
-    int page_num = top_of_ram / PAGE_SIZE;
 
-    hpt_size = 2 * page_num;
-    pagetable = (struct hpt_entry **) kmalloc(sizeof(struct hpt_entry *) * hpt_size);
-    
-    for(int i = 0; i < hpt_size; i++) {
-    	pagetable[i] = NULL;
+    /* every page in memory or in swap needs an entry */
+    int page_num = top_of_ram / PAGE_SIZE + swap_nslots();
+
+    /* keep the load factor at or below one half */
+    hpt_nparts = (2 * page_num) / HPT_MINPART;
+    if(hpt_nparts > HPT_NLOCKS) {
+        hpt_nparts = HPT_NLOCKS;
+    }
+    if(hpt_nparts == 0) {
+        hpt_nparts = 1;
+    }
+    hpt_partsize = DIVROUNDUP(2 * page_num, hpt_nparts);
+    hpt_size = hpt_nparts * hpt_partsize;
+
+    pagetable = kmalloc(sizeof(struct hpt_entry) * hpt_size);
+    if(pagetable == NULL) {
+        panic("hpt_bootstrap: Cannot allocate hash pagetable\n");
     }
+    bzero(pagetable, sizeof(struct hpt_entry) * hpt_size);
 
     /* hash pagetable is shared resource */
-    hpt_lock = lock_create("hpt_lock");
+    for(unsigned i = 0; i < hpt_nparts; i++) {
+        spinlock_init(&hpt_locks[i]);
+        hpt_ovfhead[i] = -1;
+    }
+    hpt_ovffree = -1;
+}
+
+/*
+ * hpt_ovfslot() - the overflow entry for SLOT (>= hpt_size)
+ */
+static
+struct hpt_ovfentry *
+hpt_ovfslot(int slot)
+{
+    unsigned n = slot - hpt_size;
+
+    KASSERT(slot >= hpt_size);
+    KASSERT(n / HPT_OVFCHUNK < hpt_novf);
+    return &hpt_ovf[n / HPT_OVFCHUNK][n % HPT_OVFCHUNK];
+}
+
+/*
+ * hpt_entry() - the page table entry in SLOT, in the array or in
+ * the overflow area
+ */
+static
+struct hpt_entry *
+hpt_entry(int slot)
+{
+    KASSERT(slot >= 0);
+    if(slot < hpt_size) {
+        return &pagetable[slot];
+    }
+    return &hpt_ovfslot(slot)->oe_pte;
+}
+
+/*
+ * hpt_slotpart() - the partition SLOT belongs to. Only meaningful
+ * while the slot is in use; an owner can call it without the lock.
+ */
+static
+unsigned
+hpt_slotpart(int slot)
+{
+    if(slot < hpt_size) {
+        return slot / hpt_partsize;
+    }
+    return hpt_ovfslot(slot)->oe_part;
+}
+
+/*
+ * hpt_ovfalloc() - take a free overflow slot and put it on PART's
+ * chain. Returns -1 if there is none; see hpt_ovfgrow. The caller
+ * holds the partition lock.
+ */
+static
+int
+hpt_ovfalloc(unsigned part)
+{
+    struct hpt_ovfentry *oe;
+    int slot;
+
+    KASSERT(spinlock_do_i_hold(&hpt_locks[part]));
+
+    spinlock_acquire(&hpt_ovflock);
+    slot = hpt_ovffree;
+    if(slot >= 0) {
+        hpt_ovffree = hpt_ovfslot(slot)->oe_next;
+    }
+    spinlock_release(&hpt_ovflock);
+
+    if(slot >= 0) {
+        oe = hpt_ovfslot(slot);
+        oe->oe_part = part;
+        oe->oe_next = hpt_ovfhead[part];
+        hpt_ovfhead[part] = slot;
+    }
+    return slot;
+}
+
+/*
+ * hpt_ovfgrow() - add a chunk of free overflow slots. Called with no
+ * locks held, since it allocates. Returns ENOMEM if it can't.
+ */
+static
+int
+hpt_ovfgrow(void)
+{
+    struct hpt_ovfentry *chunk;
+    unsigned c;
+    int first;
+
+    chunk = kmalloc(sizeof(struct hpt_ovfentry) * HPT_OVFCHUNK);
+    if(chunk == NULL) {
+        return ENOMEM;
+    }
+    bzero(chunk, sizeof(struct hpt_ovfentry) * HPT_OVFCHUNK);
+
+    spinlock_acquire(&hpt_ovflock);
+    if(hpt_ovffree >= 0 || hpt_novf == HPT_MAXOVF) {
+        /* somebody else grew it meanwhile, or it's as big as it gets */
+        spinlock_release(&hpt_ovflock);
+        kfree(chunk);
+        return hpt_ovffree >= 0 ? 0 : ENOMEM;
+    }
+    c = hpt_novf;
+    first = hpt_size + c * HPT_OVFCHUNK;
+    for(unsigned i = 0; i < HPT_OVFCHUNK; i++) {
+        chunk[i].oe_next = i + 1 < HPT_OVFCHUNK ? first + (int)i + 1 : -1;
+    }
+    hpt_ovf[c] = chunk;
+    hpt_novf = c + 1;
+    hpt_ovffree = first;
+    spinlock_release(&hpt_ovflock);
+
+    return 0;
+}
+
+/*
+ * hpt_probe() - walk the probe sequence for (as, VPN) inside its
+ * partition, and then the partition's overflow chain. Returns the
+ * slot holding the entry, or -1 if it isn't there; in that case
+ * *freeslot gets the first reusable slot seen in the partition
+ * (tombstone or empty), or -1 if the partition is full. The caller
+ * must hold the partition lock.
+ */
+static
+int
+hpt_probe(unsigned part, uint32_t hash, struct addrspace *as, vaddr_t VPN,
+          int *freeslot)
+{
+    unsigned base = part * hpt_partsize;
+    unsigned off = (hash / hpt_nparts) % hpt_partsize;
+    struct hpt_entry *pte;
+
+    *freeslot = -1;
+    for(unsigned n = 0; n < hpt_partsize; n++) {
+        pte = &pagetable[base + off];
+        if(pte->PID == NULL) {
+            /* end of the probe sequence */
+            if(*freeslot < 0) {
+                *freeslot = base + off;
+            }
+            break;
+        }
+        if(pte->PID == HPT_DELETED) {
+            if(*freeslot < 0) {
+                *freeslot = base + off;
+            }
+        }else if(pte->PID == as && pte->VPN == VPN) {
+            return base + off;
+        }
+        off = (off + 1) % hpt_partsize;
+    }
+
+    /* it may have gone into overflow while the partition was full */
+    for(int slot = hpt_ovfhead[part]; slot >= 0;
+        slot = hpt_ovfslot(slot)->oe_next) {
+        pte = &hpt_ovfslot(slot)->oe_pte;
+        if(pte->PID == as && pte->VPN == VPN) {
+            return slot;
+        }
+    }
+    return -1;
 }
 
 void
@@ -50,9 +352,497 @@ vm_bootstrap(void)
      * frame table here as well.
     */
  
+    /* open swap first; the pagetable is sized to cover it too */
+    swap_bootstrap();
+
     /* allocate a range of memory for hash page table which won’t be managed by frame_table. */
     hpt_bootstrap();
     frametable_bootstrap();
+    as_bootstrap();
+
+    /* generation 0 is never valid, so a zeroed as_asid[] means none */
+    for(unsigned i = 0; i < MAXCPUS; i++) {
+        asid_cpus[i].ac_generation = 1;
+        asid_cpus[i].ac_next = 1;
+    }
+
+    vm_resetstats();
+}
+
+/*
+ * vm_countfault() - bump this cpu's fault counters
+ */
+static
+void
+vm_countfault(int faulttype, bool newpage, int cow, bool pagein)
+{
+    struct vm_cpustats *stats;
+    int spl;
+
+    /* stay on this cpu while updating its slot */
+    spl = splhigh();
+    stats = &vm_stats[curcpu->c_number];
+    stats->vs_faults++;
+    if(faulttype == VM_FAULT_READ) {
+        stats->vs_readfaults++;
+    }else if(faulttype == VM_FAULT_WRITE) {
+        stats->vs_writefaults++;
+    }
+    if(newpage) {
+        stats->vs_newpages++;
+    }
+    if(cow > 0) {
+        stats->vs_cowcopies++;
+    }else if(cow == 0) {
+        stats->vs_cowreuses++;
+    }
+    if(pagein) {
+        stats->vs_pageins++;
+    }
+    splx(spl);
+}
+
+/*
+ * vm_resetstats() - zero the fault counters and restart the clock
+ */
+void
+vm_resetstats(void)
+{
+    int spl = splhigh();
+    bzero(vm_stats, sizeof(vm_stats));
+    splx(spl);
+    gettime(&vm_stats_start);
+}
+
+/*
+ * vm_printstats() - print fault counters and fault throughput since
+ * the last reset, for the kernel menu
+ */
+void
+vm_printstats(void)
+{
+    struct vm_cpustats total;
+    struct timespec now, elapsed;
+    uint64_t msecs;
+
+    bzero(&total, sizeof(total));
+    for(unsigned i = 0; i < MAXCPUS; i++) {
+        total.vs_faults += vm_stats[i].vs_faults;
+        total.vs_readfaults += vm_stats[i].vs_readfaults;
+        total.vs_writefaults += vm_stats[i].vs_writefaults;
+        total.vs_newpages += vm_stats[i].vs_newpages;
+        total.vs_cowcopies += vm_stats[i].vs_cowcopies;
+        total.vs_cowreuses += vm_stats[i].vs_cowreuses;
+        total.vs_pageins += vm_stats[i].vs_pageins;
+        total.vs_evictions += vm_stats[i].vs_evictions;
+        total.vs_asidallocs += vm_stats[i].vs_asidallocs;
+        total.vs_tlbflushes += vm_stats[i].vs_tlbflushes;
+    }
+
+    gettime(&now);
+    timespec_sub(&now, &vm_stats_start, &elapsed);
+    msecs = elapsed.tv_sec * 1000ULL + elapsed.tv_nsec / 1000000;
+
+    kprintf("vm: %u faults (%u read, %u write), %u new pages\n",
+        total.vs_faults, total.vs_readfaults, total.vs_writefaults,
+        total.vs_newpages);
+    kprintf("vm: %u copy-on-write copies, %u sole-owner upgrades\n",
+        total.vs_cowcopies, total.vs_cowreuses);
+    kprintf("vm: %u pages evicted, %u faults paged in from swap\n",
+        total.vs_evictions, total.vs_pageins);
+    kprintf("vm: %u ASIDs assigned, %u TLB flushes\n",
+        total.vs_asidallocs, total.vs_tlbflushes);
+    kprintf("vm: %llu.%03llu seconds elapsed",
+        msecs / 1000, msecs % 1000);
+    if(msecs > 0) {
+        kprintf(", %llu faults/sec",
+            (unsigned long long)total.vs_faults * 1000 / msecs);
+    }
+    kprintf("\n");
+    for(unsigned i = 0; i < MAXCPUS; i++) {
+        if(vm_stats[i].vs_faults > 0) {
+            kprintf("vm:   cpu%u: %u faults\n", i, vm_stats[i].vs_faults);
+        }
+    }
+    swap_printstats();
+}
+
+/*
+ * vm_tlbshootdown_page() - remove page VPN of AS from every cpu's TLB
+ * and wait until that has happened. Used for page-out, where AS may
+ * be running on another cpu right now.
+ */
+static
+void
+vm_tlbshootdown_page(struct addrspace *as, vaddr_t VPN)
+{
+    struct tlbshootdown ts;
+    unsigned sent;
+    int spl;
+
+    ts.ts_as = as;
+    ts.ts_vaddr = VPN;
+
+    spl = splhigh();
+    vm_tlbinvalidate_cpu(as, VPN);
+    splx(spl);
+
+    sent = ipi_tlbshootdown_allcpus(&ts);
+
+    /* every other cpu acknowledges from its IPI handler */
+    spinlock_acquire(&vm_shootdown_lock);
+    vm_shootdown_pending += sent;
+    while(vm_shootdown_pending > 0) {
+        spinlock_release(&vm_shootdown_lock);
+        spinlock_acquire(&vm_shootdown_lock);
+    }
+    spinlock_release(&vm_shootdown_lock);
+}
+
+/*
+ * vm_pageout() - write the frame PADDR, which holds page VPN of AS,
+ * out to swap and take it away from AS. The frame has been marked busy
+ * by frame_pickvictim. SWAPSLOT is a slot already holding a copy of
+ * the page (from when it was last paged in), or -1.
+ */
+static
+int
+vm_pageout(paddr_t paddr, struct addrspace *as, vaddr_t vpn, int swapslot)
+{
+    paddr_t pte, busy;
+    unsigned slot;
+    int result;
+
+    /*
+     * Check the mapping is still there, still a sole mapping, and
+     * park it as busy so that its owner waits for us on swap_lock.
+     */
+    if(hpt_markbusy(as, vpn, paddr, &pte) != 0) {
+        return EAGAIN;
+    }
+    busy = (pte & PAGE_FRAME) | HPT_BUSY;
+
+    /* from here on nobody can write to the frame */
+    vm_tlbshootdown_page(as, vpn);
+
+    /*
+     * A page that hasn't been made writable since it came in from
+     * swap still has an up-to-date copy there.
+     */
+    if(swapslot < 0 || (pte & TLBLO_DIRTY) != 0) {
+        if(swapslot >= 0) {
+            slot = swapslot;
+        }else {
+            result = swap_alloc(&slot);
+            if(result) {
+                hpt_update(as, vpn, busy, pte);
+                return result;
+            }
+        }
+
+        result = swap_out(paddr, slot);
+        if(result) {
+            if(swapslot < 0) {
+                swap_free(slot);
+            }
+            hpt_update(as, vpn, busy, pte);
+            return result;
+        }
+    }else {
+        slot = swapslot;
+    }
+
+    /* the page table entry now owns the slot */
+    hpt_update(as, vpn, busy, ((paddr_t)slot << 12) | HPT_SWAPPED);
+    return 0;
+}
+
+/*
+ * vm_evict() - reclaim one frame by paging out a victim chosen by the
+ * clock. Returns the frame's physical address, now owned by the caller
+ * with a reference count of 1, or 0 if nothing could be evicted.
+ */
+static
+paddr_t
+vm_evict(void)
+{
+    struct addrspace *as;
+    vaddr_t vpn;
+    paddr_t paddr;
+    int swapslot;
+    int result;
+    int spl;
+
+    lock_acquire(swap_lock);
+
+    for(int tries = 0; tries < VM_EVICT_TRIES; tries++) {
+        paddr = frame_pickvictim(&as, &vpn, &swapslot);
+        if(paddr == 0) {
+            break;
+        }
+
+        result = vm_pageout(paddr, as, vpn, swapslot);
+        if(result == 0) {
+            frame_unbusy(paddr, true);
+            lock_release(swap_lock);
+
+            spl = splhigh();
+            vm_stats[curcpu->c_number].vs_evictions++;
+            splx(spl);
+
+            return paddr;
+        }
+
+        frame_unbusy(paddr, false);
+        if(result != EAGAIN) {
+            /* swap is full or broken; another victim won't help */
+            break;
+        }
+    }
+
+    lock_release(swap_lock);
+    return 0;
+}
+
+/*
+ * vm_allocpage() - get a zeroed frame for a user page, evicting
+ * something if memory is short. Returns 0 if out of memory.
+ */
+static
+paddr_t
+vm_allocpage(void)
+{
+    vaddr_t kvaddr;
+    paddr_t paddr;
+
+    if(swap_enabled && frametable_freecount() < VM_MINFREE) {
+        paddr = vm_evict();
+        if(paddr != 0) {
+            bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+            return paddr;
+        }
+    }
+
+    kvaddr = alloc_kpages(1);
+    if(kvaddr != 0) {
+        return KVADDR_TO_PADDR(kvaddr);
+    }
+
+    if(swap_enabled) {
+        paddr = vm_evict();
+        if(paddr != 0) {
+            bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+            return paddr;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * vm_pagewait() - wait for a page that is being paged out
+ */
+static
+void
+vm_pagewait(void)
+{
+    lock_acquire(swap_lock);
+    lock_release(swap_lock);
+}
+
+/*
+ * vm_pagein() - bring page VPN of AS back from the swap slot recorded
+ * in PTE. The slot is kept as a clean copy, and the page is mapped
+ * write-protected so the first write (which makes the copy stale)
+ * goes through vm_cowfault.
+ */
+static
+int
+vm_pagein(struct addrspace *as, vaddr_t vpn, paddr_t pte)
+{
+    unsigned slot = pte >> 12;
+    paddr_t paddr;
+    int result;
+
+    paddr = vm_allocpage();
+    if(paddr == 0) {
+        return ENOMEM;
+    }
+
+    result = swap_in(slot, paddr);
+    if(result) {
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return result;
+    }
+
+    if(hpt_update(as, vpn, pte, paddr | TLBLO_VALID)) {
+        frame_setowner(paddr, as, vpn, slot);
+    }else {
+        free_kpages(PADDR_TO_KVADDR(paddr));
+    }
+    return 0;
+}
+
+/*
+ * vm_cowfault() - handle a write to a write-protected page in a
+ * writable region, whose page table entry is PTE. If someone else still
+ * shares the frame (copy-on-write since a fork), give this address
+ * space its own copy; if we are the last sharer, or the page is merely
+ * clean since it came in from swap, just make it writable. Sets *COPIED
+ * to say which.
+ */
+static
+int
+vm_cowfault(struct addrspace *as, vaddr_t vpn, paddr_t pte, int *copied)
+{
+    paddr_t oldpfn = pte & PAGE_FRAME;
+    paddr_t newpfn;
+
+    if(frame_getref(oldpfn) == 1) {
+        /* sole owner; nobody else can see writes to this frame */
+        *copied = 0;
+        hpt_update(as, vpn, pte, pte | TLBLO_DIRTY);
+        return 0;
+    }
+
+    newpfn = vm_allocpage();
+    if(newpfn == 0) {
+        return ENOMEM;
+    }
+    memcpy((void *)PADDR_TO_KVADDR(newpfn), (void *)PADDR_TO_KVADDR(oldpfn),
+           PAGE_SIZE);
+
+    if(!hpt_update(as, vpn, pte, newpfn | TLBLO_VALID | TLBLO_DIRTY)) {
+        /* lost a race; let the fault be retried */
+        free_kpages(PADDR_TO_KVADDR(newpfn));
+        return 0;
+    }
+    frame_setowner(newpfn, as, vpn, -1);
+
+    /* drop our reference to the shared frame */
+    free_kpages(PADDR_TO_KVADDR(oldpfn));
+
+    /* other cpus may still cache the old frame for this page */
+    vm_tlbinvalidate(as, vpn);
+
+    *copied = 1;
+    return 0;
+}
+
+/*
+ * vm_readpage() - fill the part of frame PADDR, holding page VPN of
+ * REGION, that is backed by the region's executable. The frame is
+ * already zeroed, which takes care of BSS.
+ */
+static
+int
+vm_readpage(struct region *region, vaddr_t vpn, paddr_t paddr)
+{
+    vaddr_t start, end;
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    start = vpn;
+    end = vpn + PAGE_SIZE;
+    if(start < region->filebase) {
+        start = region->filebase;
+    }
+    if(end > region->filebase + region->filesz) {
+        end = region->filebase + region->filesz;
+    }
+    if(start >= end) {
+        /* all zero-fill */
+        return 0;
+    }
+
+    uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vpn)),
+              end - start, region->fileoff + (start - region->filebase),
+              UIO_READ);
+    result = VOP_READ(region->vn, &ku);
+    if(result) {
+        return result;
+    }
+
+    if(ku.uio_resid != 0) {
+        /* short read; problem with executable? */
+        kprintf("vm: short read on page 0x%x - file truncated?\n", vpn);
+        return ENOEXEC;
+    }
+    return 0;
+}
+
+/*
+ * vm_newpage() - first touch of a page: give it a zero-filled frame,
+ * or for text and data, read it from the executable
+ */
+static
+int
+vm_newpage(struct addrspace *as, struct region *region, vaddr_t vpn)
+{
+    paddr_t paddr;
+    int result;
+
+    paddr = vm_allocpage();
+    if(paddr == 0) {
+        return ENOMEM;
+    }
+
+    if(region->vn != NULL) {
+        result = vm_readpage(region, vpn, paddr);
+        if(result) {
+            free_kpages(PADDR_TO_KVADDR(paddr));
+            return result;
+        }
+    }
+
+    /* insert pte into hash pagetable */
+    result = hpt_insert(as, vpn, paddr, region->write);
+    if(result) {
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        return result;
+    }
+    frame_setowner(paddr, as, vpn, -1);
+    return 0;
+}
+
+/*
+ * vm_tryload() - if page VPN of AS is resident (and writable, if
+ * WRITE), load it into the TLB and return 0. Otherwise return the
+ * page table entry in *PTE (0 if there is none) for the caller to act
+ * on, and EAGAIN. The TLB is loaded with the partition lock held so a
+ * concurrent page-out either sees our TLB entry in its shootdown or
+ * we see its busy mark.
+ */
+static
+int
+vm_tryload(struct addrspace *as, vaddr_t vpn, bool write, paddr_t *pte)
+{
+    uint32_t hash = hpt_hash(as, vpn);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+    paddr_t pfn;
+
+    spinlock_acquire(&hpt_locks[part]);
+
+    slot = hpt_probe(part, hash, as, vpn, &freeslot);
+    if(slot < 0) {
+        spinlock_release(&hpt_locks[part]);
+        *pte = 0;
+        return EAGAIN;
+    }
+
+    pfn = hpt_entry(slot)->PFN;
+    if((pfn & TLBLO_VALID) && (!write || (pfn & TLBLO_DIRTY))) {
+        write_tlb(as, vpn, pfn);
+        frame_touch(pfn & PAGE_FRAME, as, vpn);
+        spinlock_release(&hpt_locks[part]);
+        return 0;
+    }
+
+    spinlock_release(&hpt_locks[part]);
+    *pte = pfn;
+    return EAGAIN;
 }
 
 /*
@@ -64,6 +854,11 @@ int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
     struct addrspace *as;
+    bool newpage = false;
+    bool pagein = false;
+    int cow = -1;
+    paddr_t pte;
+    int result;
 
     if (curproc == NULL) {
     	return EFAULT;
@@ -81,8 +876,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     /* Fault type arguments */
     switch (faulttype) {
         case VM_FAULT_READONLY:
-            return EFAULT;
-
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
         break;
@@ -100,75 +893,181 @@ vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 
-    /* check for valid translation */
-    struct hpt_entry * valid_pte = hpt_lookup(as, vpn);
+    /* writes to a readonly region are real protection faults */
+    bool write = (faulttype != VM_FAULT_READ);
+    if(write && region->write == 0) {
+        return EFAULT;
+    }
 
-    /* if there isn't a valid translation, create one */
-    if(valid_pte == NULL) {
-        vaddr_t alloc_vaddr = alloc_kpages(1);  
-        if(alloc_vaddr == 0) {
-            return ENOMEM;
+    /* until the translation is in the TLB */
+    while(vm_tryload(as, vpn, write, &pte) != 0) {
+        if(pte == 0) {
+            if(faulttype == VM_FAULT_READONLY) {
+                /* TLB had a translation we don't know about */
+                return EFAULT;
+            }
+            result = vm_newpage(as, region, vpn);
+            newpage = true;
+        }else if(pte & HPT_BUSY) {
+            vm_pagewait();
+            result = 0;
+        }else if(pte & HPT_SWAPPED) {
+            result = vm_pagein(as, vpn, pte);
+            pagein = true;
+        }else {
+            /*
+             * Writable region but write-protected page: shared
+             * copy-on-write since a fork, or clean since it came in
+             * from swap.
+             */
+            result = vm_cowfault(as, vpn, pte, &cow);
         }
-
-        /* get PFN of the allocated frame */
-        paddr_t pfn = KVADDR_TO_PADDR(alloc_vaddr);
-        pfn  = pfn & PAGE_FRAME;
-    
-        /* get dirty bit */
-        int dirty_bit = region->write;
-
-        /* insert pte into hash pagetable */
-        valid_pte = hpt_insert(as, vpn, pfn, dirty_bit);
-        if(valid_pte == NULL) {
-            return ENOMEM;
+        if(result) {
+            return result;
         }
-        
     }
 
-    /* load TLB */
-    vaddr_t VPN = valid_pte->VPN;
-    paddr_t PFN = valid_pte->PFN;
-    write_tlb(VPN, PFN);
+    vm_countfault(faulttype, newpage, cow, pagein);
     
     return 0;
 }
 
 /*
- * hpt_lookup() - Find a match in hash pagetable 
+ * vm_sharepage() - take a copy-on-write reference to page VPN of AS
+ * for fork: write-protect it in AS and return its frame in *PADDR with
+ * the frame's reference count already raised. Pages out in swap are
+ * brought back in first. Returns ENOENT if the page was never touched.
  */
-struct hpt_entry *
-hpt_lookup(struct addrspace * as, vaddr_t VPN) 
+int
+vm_sharepage(struct addrspace *as, vaddr_t vpn, paddr_t *paddr)
 {
-    lock_acquire(hpt_lock);
+    uint32_t hash = hpt_hash(as, vpn);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+    paddr_t pfn;
+    int result;
 
-    uint32_t index = hpt_hash(as, VPN);
-    struct hpt_entry * cur_pte = pagetable[index];
-    
-    /* every entry is uniquely identified */
-    while(cur_pte != NULL) {
-    	/* by PID and virtual page number */
-        if(cur_pte->PID == as && cur_pte->VPN == VPN) {
-        /* check valid bit */
-        	uint32_t validity = cur_pte->PFN & TLBLO_VALID;
-        	if(validity == TLBLO_VALID) {
-            	lock_release(hpt_lock);
-            	return cur_pte;
-        	} 
+    while(1) {
+        spinlock_acquire(&hpt_locks[part]);
+
+        slot = hpt_probe(part, hash, as, vpn, &freeslot);
+        if(slot < 0) {
+            spinlock_release(&hpt_locks[part]);
+            return ENOENT;
+        }
+
+        pfn = hpt_entry(slot)->PFN;
+        if(pfn & TLBLO_VALID) {
+            /* under the partition lock, so the evictor can't race us */
+            hpt_entry(slot)->PFN = pfn & ~TLBLO_DIRTY;
+            frame_incref(pfn & PAGE_FRAME);
+            spinlock_release(&hpt_locks[part]);
+            *paddr = pfn & PAGE_FRAME;
+            return 0;
+        }
+        spinlock_release(&hpt_locks[part]);
+
+        if(pfn & HPT_BUSY) {
+            vm_pagewait();
+        }else {
+            result = vm_pagein(as, vpn, pfn);
+            if(result) {
+                return result;
+            }
         }
-        cur_pte = cur_pte->next_entry;
     }
+}
+
+/*
+ * vm_destroypages() - drop every page of AS, resident or in swap, and
+ * its page table entry, for as_destroy. Only the entries on the
+ * address space's own list are visited, so untouched parts of big
+ * regions cost nothing. Each entry is removed under its own
+ * partition's lock and its page freed after the lock is dropped, so
+ * faults elsewhere only ever wait for one entry. Pages caught in the
+ * middle of a page-out are left for another pass after waiting for it.
+ */
+void
+vm_destroypages(struct addrspace *as)
+{
+    int slot, next;
+    unsigned part;
+    bool busy;
+    paddr_t pfn;
 
-    lock_release(hpt_lock);
-    return NULL;
+    do {
+        busy = false;
+
+        /* only we change our own list, so it can be walked unlocked */
+        for(slot = as->as_pages; slot >= 0; slot = next) {
+            next = hpt_entry(slot)->as_next;
+            part = hpt_slotpart(slot);
+
+            spinlock_acquire(&hpt_locks[part]);
+            pfn = hpt_entry(slot)->PFN;
+            if(pfn & HPT_BUSY) {
+                spinlock_release(&hpt_locks[part]);
+                busy = true;
+                continue;
+            }
+            hpt_remove(part, slot);
+            spinlock_release(&hpt_locks[part]);
+
+            if(pfn & HPT_SWAPPED) {
+                swap_free(pfn >> 12);
+            }else {
+                /* drop our reference to the physical frame */
+                free_kpages(PADDR_TO_KVADDR(pfn & PAGE_FRAME));
+            }
+        }
+
+        if(busy) {
+            vm_pagewait();
+        }
+    } while(busy);
+
+    KASSERT(as->as_pages == -1);
 }
 
 /*
- * hpt_insert() - insert new entry into hash page table 
+ * hpt_lookup() - Find a match in hash pagetable and copy its PFN word
+ * out to *PFN. Returns false if there is none. The entry may be
+ * resident (TLBLO_VALID), in swap (HPT_SWAPPED), or being paged out
+ * (HPT_BUSY). The slot itself is only stable under its partition
+ * lock, so no pointer to it is handed out; the copy can go stale
+ * unless you are the page's owner.
  */
-struct hpt_entry *
+bool
+hpt_lookup(struct addrspace * as, vaddr_t VPN, paddr_t *PFN) 
+{
+    uint32_t hash = hpt_hash(as, VPN);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+
+    spinlock_acquire(&hpt_locks[part]);
+
+    /* every entry is uniquely identified by PID and virtual page number */
+    slot = hpt_probe(part, hash, as, VPN, &freeslot);
+    if(slot >= 0) {
+        *PFN = hpt_entry(slot)->PFN;
+    }
+
+    spinlock_release(&hpt_locks[part]);
+    return slot >= 0;
+}
+
+/*
+ * hpt_insert() - insert new entry into hash page table. If the
+ * entry's partition is full it goes into overflow, which may need to
+ * grow; returns ENOMEM if that can't be done.
+ */
+int
 hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit) 
 {	
-    uint32_t index;
+    uint32_t hash = hpt_hash(as, VPN);
+    unsigned part = hash % hpt_nparts;
+    struct hpt_entry *pte;
+    int slot, freeslot, result;
 
     if(dirty_bit > 0) {
         PFN = PFN | TLBLO_DIRTY;
@@ -176,105 +1075,382 @@ hpt_insert(struct addrspace * as, vaddr_t VPN, paddr_t PFN, int dirty_bit)
 
     PFN = PFN | TLBLO_VALID;    
 
-    lock_acquire(hpt_lock);
+    while(1) {
+        spinlock_acquire(&hpt_locks[part]);
+
+        slot = hpt_probe(part, hash, as, VPN, &freeslot);
+        if(slot < 0) {
+            slot = freeslot;
+        }
+        if(slot < 0) {
+            slot = hpt_ovfalloc(part);
+        }
+        if(slot >= 0) {
+            break;
+        }
 
-    index = hpt_hash(as, VPN);
-    struct hpt_entry * cur = pagetable[index];
-    struct hpt_entry *new = kmalloc(sizeof(struct hpt_entry));
+        /* no room anywhere; make some without the lock and retry */
+        spinlock_release(&hpt_locks[part]);
+        result = hpt_ovfgrow();
+        if(result) {
+            return result;
+        }
+    }
 
-    /* initialise pte */
-    new->PID = as;
-    new->VPN = VPN; 
-    new->PFN = PFN; 
-    new->next_entry = NULL;
+    /* initialise pte, reusing any stale entry for the same page */
+    pte = hpt_entry(slot);
+    if(pte->PID != as) {
+        hpt_link(as, slot);
+    }
+    pte->PID = as;
+    pte->VPN = VPN;
+    pte->PFN = PFN;
 
-    /* insert into hash pagetable in the appropriate location */
-    if(cur == NULL) {
-        pagetable[index] = new;
-        lock_release(hpt_lock);
-        return new;
-    }else {
-        while(cur->next_entry != NULL) {
-        cur = cur->next_entry;
+    spinlock_release(&hpt_locks[part]);
+    return 0;
+}
+
+/*
+ * hpt_update() - replace the PFN word of the entry for (AS, VPN) with
+ * NEWPFN, but only if it is still EXPECTED. Returns true if it was.
+ */
+bool
+hpt_update(struct addrspace *as, vaddr_t VPN, paddr_t expected, paddr_t newpfn)
+{
+    uint32_t hash = hpt_hash(as, VPN);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+    bool ret = false;
+
+    spinlock_acquire(&hpt_locks[part]);
+
+    slot = hpt_probe(part, hash, as, VPN, &freeslot);
+    if(slot >= 0 && hpt_entry(slot)->PFN == expected) {
+        hpt_entry(slot)->PFN = newpfn;
+        ret = true;
+    }
+
+    spinlock_release(&hpt_locks[part]);
+    return ret;
+}
+
+/*
+ * hpt_markbusy() - for page-out: if (AS, VPN) is still resident in
+ * frame PADDR and nobody else shares the frame, mark it HPT_BUSY and
+ * return its old PFN word in *OLDPFN. Checking the reference count
+ * under the partition lock keeps fork (vm_sharepage) from sharing the
+ * frame behind our back.
+ */
+int
+hpt_markbusy(struct addrspace *as, vaddr_t VPN, paddr_t paddr, paddr_t *oldpfn)
+{
+    uint32_t hash = hpt_hash(as, VPN);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+    paddr_t pfn;
+    int ret = ENOENT;
+
+    spinlock_acquire(&hpt_locks[part]);
+
+    slot = hpt_probe(part, hash, as, VPN, &freeslot);
+    if(slot >= 0) {
+        pfn = hpt_entry(slot)->PFN;
+        if((pfn & TLBLO_VALID) && (pfn & PAGE_FRAME) == paddr &&
+           frame_getref(paddr) == 1) {
+            hpt_entry(slot)->PFN = paddr | HPT_BUSY;
+            *oldpfn = pfn;
+            ret = 0;
         }
-        cur->next_entry = new;
-        lock_release(hpt_lock);
-        return new;
     }
 
-    lock_release(hpt_lock);
-    /* can't inserted an entry */
-    return NULL;
+    spinlock_release(&hpt_locks[part]);
+    return ret;
 }
 
 /*
- * hpt_delete() - Find and delete an entry of hash pagetable
+ * hpt_link() - put SLOT on AS's list of page table entries.
+ *
+ * The list is threaded through the entries' as_next/as_prev slot
+ * numbers, which is possible because an entry never moves once
+ * inserted. It changes only when an entry is inserted or removed,
+ * which only the owning thread does (and fork, for a child that isn't
+ * running yet), so it needs no lock of its own.
  */
+static
 void
-hpt_delete(struct addrspace * as, vaddr_t VPN)
+hpt_link(struct addrspace *as, int slot)
+{
+    hpt_entry(slot)->as_prev = -1;
+    hpt_entry(slot)->as_next = as->as_pages;
+    if(as->as_pages >= 0) {
+        hpt_entry(as->as_pages)->as_prev = slot;
+    }
+    as->as_pages = slot;
+}
+
+/*
+ * hpt_unlink() - take SLOT off AS's list of page table entries
+ */
+static
+void
+hpt_unlink(struct addrspace *as, int slot)
+{
+    int next = hpt_entry(slot)->as_next;
+    int prev = hpt_entry(slot)->as_prev;
+
+    if(prev >= 0) {
+        hpt_entry(prev)->as_next = next;
+    }else {
+        as->as_pages = next;
+    }
+    if(next >= 0) {
+        hpt_entry(next)->as_prev = prev;
+    }
+    hpt_entry(slot)->as_next = -1;
+    hpt_entry(slot)->as_prev = -1;
+}
+
+/*
+ * hpt_ovfremove() - take overflow SLOT off PART's chain and free it.
+ * The caller holds the partition lock.
+ */
+static
+void
+hpt_ovfremove(unsigned part, int slot)
+{
+    struct hpt_ovfentry *oe = hpt_ovfslot(slot);
+    int *pp;
+
+    pp = &hpt_ovfhead[part];
+    while(*pp != slot) {
+        KASSERT(*pp >= 0);
+        pp = &hpt_ovfslot(*pp)->oe_next;
+    }
+    *pp = oe->oe_next;
+
+    oe->oe_pte.PID = NULL;
+    oe->oe_pte.VPN = 0;
+    oe->oe_pte.PFN = 0;
+
+    spinlock_acquire(&hpt_ovflock);
+    oe->oe_next = hpt_ovffree;
+    hpt_ovffree = slot;
+    spinlock_release(&hpt_ovflock);
+}
+
+/*
+ * hpt_remove() - turn SLOT of partition PART into a tombstone, or
+ * free it if it's an overflow slot. The caller holds the partition
+ * lock.
+ */
+static
+void
+hpt_remove(unsigned part, int slot)
 {
-    lock_acquire(hpt_lock);
-    uint32_t index = hpt_hash(as, VPN);
-    struct hpt_entry *cur = pagetable[index];
-    struct hpt_entry *temp;
+    unsigned base = part * hpt_partsize;
+    unsigned off;
+
+    KASSERT(spinlock_do_i_hold(&hpt_locks[part]));
+
+    hpt_unlink(hpt_entry(slot)->PID, slot);
 
-    /* only one in the linked list */
-    if(cur->next_entry == NULL && cur->PID == as && cur->VPN == VPN) {
-        pagetable[index] = NULL;
-        kfree(cur);
-        lock_release(hpt_lock);
+    if(slot >= hpt_size) {
+        hpt_ovfremove(part, slot);
         return;
     }
 
-    /* there is more than one pagetable entry in the link list */
-    struct hpt_entry *prev = pagetable[index];
-    while(cur != NULL) {
-        if(cur->PID == as && cur->VPN == VPN) {
-        /* first one in the list */
-        if(pagetable[index] == cur) {
-            temp = cur;
-            pagetable[index] = cur->next_entry;
-            cur = cur->next_entry;
-            prev = cur->next_entry;
-        }else {
-            temp = cur;
-            prev->next_entry = cur->next_entry;
-            cur = cur->next_entry;
+    hpt_entry(slot)->PID = HPT_DELETED;
+    hpt_entry(slot)->VPN = 0;
+    hpt_entry(slot)->PFN = 0;
+
+    /*
+     * If the next slot ends the probe sequence, nothing can be
+     * behind this tombstone; clear it and any tombstones before it.
+     */
+    off = slot - base;
+    if(pagetable[base + (off + 1) % hpt_partsize].PID == NULL) {
+        for(unsigned n = 0; n < hpt_partsize; n++) {
+            if(pagetable[base + off].PID != HPT_DELETED) {
+                break;
+            }
+            pagetable[base + off].PID = NULL;
+            off = (off + hpt_partsize - 1) % hpt_partsize;
         }
-        kfree(temp);
-        
-        /* continue checking next entry */
-        }else {
-        	prev = cur;
-        	cur = cur->next_entry;
+    }
+}
+
+/*
+ * hpt_delete() - Find and delete an entry of hash pagetable
+ */
+void
+hpt_delete(struct addrspace * as, vaddr_t VPN)
+{
+    uint32_t hash = hpt_hash(as, VPN);
+    unsigned part = hash % hpt_nparts;
+    int slot, freeslot;
+
+    spinlock_acquire(&hpt_locks[part]);
+
+    slot = hpt_probe(part, hash, as, VPN, &freeslot);
+    if(slot >= 0) {
+        hpt_remove(part, slot);
+    }
+
+    spinlock_release(&hpt_locks[part]);
+}
+
+/*
+ * vm_activate() - make AS the current address space on this cpu by
+ * loading its ASID, handing it a fresh one if it has none here yet or
+ * if its one is from an older generation
+ */
+void
+vm_activate(struct addrspace *as)
+{
+    struct asid_cpu *ac;
+    unsigned cpu;
+    uint32_t ctx;
+    int spl;
+
+    /* stay on this cpu, and keep the TLB to ourselves */
+    spl = splhigh();
+
+    cpu = curcpu->c_number;
+    ac = &asid_cpus[cpu];
+    ctx = as->as_asid[cpu];
+
+    if(ctx == 0 || (ctx >> ASID_GENSHIFT) != ac->ac_generation) {
+        if(ac->ac_next == NUM_ASID) {
+            /* out of ASIDs; start over with an empty TLB */
+            ac->ac_generation++;
+            ac->ac_next = 1;
+            tlb_flush();
+            vm_stats[cpu].vs_tlbflushes++;
         }
+        ctx = (ac->ac_generation << ASID_GENSHIFT) | ac->ac_next;
+        ac->ac_next++;
+        as->as_asid[cpu] = ctx;
+        vm_stats[cpu].vs_asidallocs++;
     }
-    
-    lock_release(hpt_lock);
+
+    ac->ac_curhi = (ctx & ASID_MASK) << TLBHI_PIDSHIFT;
+    tlb_setentryhi(ac->ac_curhi);
+
+    splx(spl);
 }
 
 /*
- * write_tlb() - write to tlb
+ * write_tlb() - write to tlb, tagged with the ASID of AS on this cpu.
+ * Replaces any entry already there for the page, e.g. a read-only
+ * entry being upgraded after a copy-on-write fault.
  */
 void 
-write_tlb(vaddr_t VPN, paddr_t PFN)
+write_tlb(struct addrspace *as, vaddr_t VPN, paddr_t PFN)
 {
     uint32_t entryhi, entrylo;
+    uint32_t asid;
+    int index;
 
     int spl;
     // Disable interrupte when write to TLB
     spl = splhigh();
 
-    entryhi = VPN;
+    asid = as->as_asid[curcpu->c_number] & ASID_MASK;
+
+    entryhi = (VPN & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
     entrylo = PFN;
 
-    tlb_random(entryhi, entrylo);
+    index = tlb_probe(entryhi, 0);
+    if(index >= 0) {
+        tlb_write(entryhi, entrylo, index);
+    }else {
+        tlb_random(entryhi, entrylo);
+    }
 
     splx(spl);
 }
 
 /*
- * tlb_flush() - flush tlb for context switching
+ * vm_tlbinvalidate_cpu() - knock page VPN of AS out of this cpu's TLB,
+ * if AS has a live ASID here. Call with interrupts off.
+ */
+static
+void
+vm_tlbinvalidate_cpu(struct addrspace *as, vaddr_t VPN)
+{
+    struct asid_cpu *ac = &asid_cpus[curcpu->c_number];
+    uint32_t ctx = as->as_asid[curcpu->c_number];
+    int index;
+
+    if(ctx == 0 || (ctx >> ASID_GENSHIFT) != ac->ac_generation) {
+        /* no ASID here, or only one whose entries were flushed */
+        return;
+    }
+
+    index = tlb_probe((VPN & TLBHI_VPAGE) |
+                      ((ctx & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+    if(index >= 0) {
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+    }
+
+    /* tlb_probe/tlb_write clobbered the current ASID; put it back */
+    tlb_setentryhi(ac->ac_curhi);
+}
+
+/*
+ * vm_tlbinvalidate() - make sure no cpu keeps a stale translation for
+ * page VPN of AS, which must be the current address space. On this
+ * cpu the entry is knocked out directly. AS isn't running anywhere
+ * else (processes are single-threaded), so for other cpus it's enough
+ * to forget AS's ASID there; it gets a fresh, clean one the next time
+ * it is activated on that cpu.
+ */
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t VPN)
+{
+    unsigned cpu;
+    int spl;
+
+    KASSERT(as == proc_getas());
+
+    spl = splhigh();
+
+    cpu = curcpu->c_number;
+    for(unsigned i = 0; i < MAXCPUS; i++) {
+        if(i != cpu) {
+            as->as_asid[i] = 0;
+        }
+    }
+
+    vm_tlbinvalidate_cpu(as, VPN);
+
+    splx(spl);
+}
+
+/*
+ * vm_flushasid() - retire every ASID AS holds, so none of its TLB
+ * entries on any cpu can be matched again. Cheaper than invalidating
+ * page by page when a whole address space changes, e.g. when fork
+ * write-protects the parent. If AS is current it gets a new ASID here
+ * straight away.
+ */
+void
+vm_flushasid(struct addrspace *as)
+{
+    int spl = splhigh();
+
+    bzero(as->as_asid, sizeof(as->as_asid));
+    if(as == proc_getas()) {
+        vm_activate(as);
+    }
+
+    splx(spl);
+}
+
+/*
+ * tlb_flush() - invalidate every entry in this cpu's tlb. Only needed
+ * when the ASID space wraps. The caller must reload entryhi with the
+ * current ASID afterwards, since tlb_write leaves PID 0 in it.
  */
 void
 tlb_flush(void)
@@ -294,12 +1470,19 @@ tlb_flush(void)
 
 /*
  *
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions.
  */
 
+/*
+ * vm_tlbshootdown() - IPI handler for vm_tlbshootdown_page on another
+ * cpu: drop the page from this cpu's TLB and acknowledge.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    (void)ts;
-    panic("vm tried to do tlb shootdown?!\n");
+    vm_tlbinvalidate_cpu(ts->ts_as, ts->ts_vaddr);
+
+    spinlock_acquire(&vm_shootdown_lock);
+    vm_shootdown_pending--;
+    spinlock_release(&vm_shootdown_lock);
 }
@@ -230,8 +230,9 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
+	static const char *const levelnames[] = { "", "", "Double ", "Triple " };
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
 	unsigned i;
@@ -239,7 +240,7 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%sIndirect block %u\n", levelnames[level], block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +254,18 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	if (level > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +277,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -291,7 +305,18 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -476,6 +501,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +513,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -498,6 +529,165 @@ dumpinode(uint32_t ino, const char *name)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// fragmentation report
+
+/*
+ * Walk every file reachable from the root directory and count how
+ * many contiguous runs ("extents") of disk blocks each one is stored
+ * in. A file stored perfectly contiguously has one extent. Indirect
+ * blocks aren't counted, so a large file written sequentially with
+ * its indirect blocks interleaved still shows up as a few extents.
+ * A file with several names is counted once per name.
+ */
+
+static struct {
+	unsigned files, dirs;
+	unsigned fragmented;
+	uint32_t blocks, extents;
+	uint32_t maxextents;
+	uint32_t maxextentsino;
+} frag;
+
+static uint32_t frag_fileblocks, frag_fileextents, frag_lastblock;
+
+static void fraginode(uint32_t ino);
+
+static
+void
+fragblock(uint32_t fileblock, uint32_t diskblock)
+{
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	if (frag_fileblocks == 0 || diskblock != frag_lastblock + 1) {
+		frag_fileextents++;
+	}
+	frag_fileblocks++;
+	frag_lastblock = diskblock;
+}
+
+static
+void
+fragdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	int i;
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(&sds, diskblock);
+
+	for (i=0; i<nsds; i++) {
+		uint32_t ino = SWAP32(sds[i].sfd_ino);
+		if (ino==SFS_NOINO) {
+			continue;
+		}
+		sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+		if (!strcmp(sds[i].sfd_name, ".") ||
+		    !strcmp(sds[i].sfd_name, "..")) {
+			continue;
+		}
+		fraginode(ino);
+	}
+}
+
+static
+void
+fraginode(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+
+	diskread(&sfi, ino);
+
+	frag_fileblocks = frag_fileextents = frag_lastblock = 0;
+	traverse(&sfi, fragblock);
+
+	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+		frag.dirs++;
+	}
+	else {
+		frag.files++;
+	}
+	frag.blocks += frag_fileblocks;
+	frag.extents += frag_fileextents;
+	if (frag_fileextents > 1) {
+		frag.fragmented++;
+	}
+	if (frag_fileextents > frag.maxextents) {
+		frag.maxextents = frag_fileextents;
+		frag.maxextentsino = ino;
+	}
+
+	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR) {
+		traverse(&sfi, fragdirblock);
+	}
+}
+
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint8_t data[SFS_BLOCKSIZE];
+	uint32_t i, bn, run;
+	uint32_t freeblocks, freeextents, maxfree;
+
+	fraginode(SFS_ROOTDIR_INO);
+
+	/* Free space: count the runs of clear bits in the freemap */
+	freeblocks = freeextents = maxfree = run = 0;
+	for (i=0; i<freemapblocks; i++) {
+		diskread(data, SFS_FREEMAP_START+i);
+		for (bn = i*SFS_BITSPERBLOCK;
+		     bn < (i+1)*SFS_BITSPERBLOCK && bn < fsblocks; bn++) {
+			if (data[(bn % SFS_BITSPERBLOCK) / 8] &
+			    (1U << (bn % 8))) {
+				run = 0;
+				continue;
+			}
+			if (run == 0) {
+				freeextents++;
+			}
+			run++;
+			freeblocks++;
+			if (run > maxfree) {
+				maxfree = run;
+			}
+		}
+	}
+
+	printf("Fragmentation report\n");
+	printf("--------------------\n");
+	dumppos = 0;
+	dumpvalf("Files", "%u", frag.files);
+	dumpvalf("Directories", "%u", frag.dirs);
+	dumpvalf("Data blocks", "%u", frag.blocks);
+	dumpvalf("Data extents", "%u", frag.extents);
+	dumpvalf("Fragmented files", "%u", frag.fragmented);
+	if (frag.extents > 0) {
+		dumpvalf("Blocks per extent", "%u.%02u",
+			 frag.blocks / frag.extents,
+			 (frag.blocks % frag.extents) * 100 / frag.extents);
+	}
+	else {
+		dumpval("Blocks per extent", "-");
+	}
+	dumpvalf("Most extents", "%u (inode %u)",
+		 frag.maxextents, frag.maxextentsino);
+	dumpvalf("Free blocks", "%u", freeblocks);
+	dumpvalf("Free extents", "%u", freeextents);
+	dumpvalf("Largest free extent", "%u", maxfree);
+	if (dumppos % 2 == 1) {
+		printf("\n");
+	}
+	printf("\n");
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -513,6 +703,7 @@ usage(void)
 	warnx("   -f: dump file contents");
 	warnx("   -d: dump directory contents");
 	warnx("   -r: recurse into directory contents");
+	warnx("   -F: report file and free space fragmentation");
 	warnx("   -a: equivalent to -sbdfr -i 1");
 	errx(1, "   Default is -i 1");
 }
@@ -522,6 +713,7 @@ main(int argc, char **argv)
 {
 	bool dosb = false;
 	bool dofreemap = false;
+	bool dofrag = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
 
@@ -554,6 +746,7 @@ main(int argc, char **argv)
 				    case 'f': dofiles = true; break;
 				    case 'd': dodirs = true; break;
 				    case 'r': recurse = true; break;
+				    case 'F': dofrag = true; break;
 				    case 'a':
 					dosb = true;
 					dofreemap = true;
@@ -584,7 +777,7 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (!dosb && !dofreemap && dumpino == 0) {
+	if (!dosb && !dofreemap && !dofrag && dumpino == 0) {
 		dumpino = SFS_ROOTDIR_INO;
 	}
 
@@ -597,6 +790,9 @@ main(int argc, char **argv)
 	if (dofreemap) {
 		dumpfreemap(nblocks);
 	}
+	if (dofrag) {
+		dumpfrag(nblocks);
+	}
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
 	}
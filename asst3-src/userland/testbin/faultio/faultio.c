@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * faultio - file I/O to and from pages of the program that haven't
+ * been loaded yet.
+ *
+ * Program pages are read in from the executable when first touched,
+ * so here the kernel takes that page fault in the middle of a read
+ * or write system call, possibly on the very filesystem or device
+ * being read or written. Run it from the same volume as the file it
+ * writes (by default faultio.tmp in the current directory); e.g.
+ * boot from emu0 and run it there.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE 4096
+#define LITERAL "faultio: written from a string literal\n"
+
+/*
+ * Three pages of read-only and of initialized data, aligned so the
+ * middle page of each isn't shared with anything else and so stays
+ * untouched until the system calls below use it.
+ */
+static const char rodata_pages[3*PAGE] __attribute__((aligned(PAGE))) = {
+	[0] = 'r',
+	[PAGE] = 'T', [PAGE+1] = 'h', [PAGE+2] = 'e', [PAGE+3] = 'r',
+	[PAGE+4] = 'e', [2*PAGE-1] = '!',
+	[2*PAGE] = 'r',
+};
+
+static char data_pages[3*PAGE] __attribute__((aligned(PAGE))) = {
+	[0] = 'd',
+	[PAGE] = 'x', [2*PAGE-1] = 'x',
+	[2*PAGE] = 'd',
+};
+
+int
+main(int argc, char *argv[])
+{
+	char check[sizeof(LITERAL)];
+	const char *file;
+	ssize_t r;
+	int fd;
+
+	file = argc > 1 ? argv[1] : "faultio.tmp";
+
+	fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", file);
+	}
+	r = write(fd, LITERAL, sizeof(LITERAL));
+	if (r < 0) {
+		err(1, "%s: write of string literal", file);
+	}
+	if ((size_t)r != sizeof(LITERAL)) {
+		errx(1, "%s: short write of string literal", file);
+	}
+	r = write(fd, &rodata_pages[PAGE], PAGE);
+	if (r < 0) {
+		err(1, "%s: write from unloaded rodata page", file);
+	}
+	if (r != PAGE) {
+		errx(1, "%s: short write from rodata page", file);
+	}
+	close(fd);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", file);
+	}
+	r = read(fd, check, sizeof(check));
+	if (r < 0) {
+		err(1, "%s: read", file);
+	}
+	if ((size_t)r != sizeof(check) || memcmp(check, LITERAL, r) != 0) {
+		errx(1, "%s: string literal did not read back", file);
+	}
+	r = read(fd, &data_pages[PAGE], PAGE);
+	if (r < 0) {
+		err(1, "%s: read into unloaded data page", file);
+	}
+	if (r != PAGE) {
+		errx(1, "%s: short read into data page", file);
+	}
+	close(fd);
+
+	if (memcmp(&data_pages[PAGE], &rodata_pages[PAGE], PAGE) != 0) {
+		errx(1, "Data read back does not match what was written");
+	}
+	if (data_pages[0] != 'd' || data_pages[2*PAGE] != 'd') {
+		errx(1, "Read spilled over into the neighbouring pages");
+	}
+
+	if (remove(file) < 0) {
+		warn("%s: remove", file);
+	}
+
+	printf("Passed faultio.\n");
+	return 0;
+}
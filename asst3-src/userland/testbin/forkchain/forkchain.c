@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkchain - a long chain of processes all sharing one big array
+ * copy-on-write.
+ *
+ * Each process forks the next one and waits for it, so the whole
+ * chain is alive at once, and each process has its own page table
+ * entries for the same shared frames. With the default settings
+ * that is more entries than there are pages of memory and swap put
+ * together, which the page table has to cope with. The last process
+ * checks the array and then writes all over it; each process on the
+ * way back checks that its own view is still intact.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 256		/* size of the shared array */
+#define DEFDEPTH 64		/* processes in the chain */
+
+static char data[NPAGES*PAGE];
+static int depth;
+
+static
+char
+pattern(int page)
+{
+	return (char)(page * 7 + 1);
+}
+
+/*
+ * Fill every page of the array, so that all of them are mapped and
+ * get shared at each fork.
+ */
+static
+void
+fill(void)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		data[i*PAGE] = pattern(i);
+		data[i*PAGE + PAGE-1] = pattern(i);
+	}
+}
+
+static
+void
+check(int level)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		if (data[i*PAGE] != pattern(i) ||
+		    data[i*PAGE + PAGE-1] != pattern(i)) {
+			errx(1, "level %d: page %d is wrong", level, i);
+		}
+	}
+}
+
+static
+void
+scribble(void)
+{
+	int i;
+
+	for (i=0; i<NPAGES; i++) {
+		data[i*PAGE] = ~pattern(i);
+		data[i*PAGE + PAGE-1] = ~pattern(i);
+	}
+}
+
+/*
+ * Be process LEVEL of the chain. Returns the exit status.
+ */
+static
+int
+chain(int level)
+{
+	pid_t pid;
+	int status;
+
+	check(level);
+
+	if (level == depth) {
+		scribble();
+		return 0;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		warn("level %d: fork", level);
+		return 1;
+	}
+	if (pid == 0) {
+		exit(chain(level + 1));
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		warn("level %d: waitpid", level);
+		return 1;
+	}
+
+	/* the rest of the chain wrote its own copies, not ours */
+	check(level);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 2) {
+		errx(1, "Usage: forkchain [depth]");
+	}
+	depth = argc == 2 ? atoi(argv[1]) : DEFDEPTH;
+	if (depth < 1) {
+		errx(1, "depth must be at least 1");
+	}
+
+	fill();
+	printf("forkchain: %d processes sharing %d pages\n",
+	       depth + 1, NPAGES);
+
+	if (chain(0)) {
+		errx(1, "FAILED");
+	}
+	printf("forkchain: passed\n");
+	return 0;
+}